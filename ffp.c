@@ -1,11 +1,32 @@
 // Build:  gcc -O2 -Wall -Wextra -o ffp ffp.c
 // Run:    ./ffp --help   |   ./ffp --uci   |   ./ffp --perft 4
 
+#ifdef __linux__
+  #define _GNU_SOURCE           // CPU affinity
+  #include <sched.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
 
 #include "ffp.h"
 
@@ -31,6 +52,15 @@ static inline int LSB_INDEX(U64 b){ // portable fallback
 }
 #endif
 
+#if defined(__GNUC__) || __has_builtin(__builtin_clzll)
+  #define MSB_INDEX(b) (63-__builtin_clzll(b))
+#else
+static inline int MSB_INDEX(U64 b){ // portable fallback: keep the top bit only
+    b |= b>>1; b |= b>>2; b |= b>>4; b |= b>>8; b |= b>>16; b |= b>>32;
+    return LSB_INDEX(b ^ (b>>1));
+}
+#endif
+
 // Files
 static const U64 FILE_A = 0x0101010101010101ULL;
 static const U64 FILE_H = 0x8080808080808080ULL;
@@ -60,6 +90,64 @@ static inline int popcount64(U64 x){
 #endif
 }
 
+// Byte reversal: rank order flipped, files kept
+static inline U64 bswap64(U64 x){
+#if defined(__GNUC__) || __has_builtin(__builtin_bswap64)
+    return __builtin_bswap64(x);
+#else
+    x = (x & 0x00000000FFFFFFFFULL) << 32 | (x >> 32);
+    x = (x & 0x0000FFFF0000FFFFULL) << 16 | (x >> 16 & 0x0000FFFF0000FFFFULL);
+    return (x & 0x00FF00FF00FF00FFULL) << 8 | (x >> 8 & 0x00FF00FF00FF00FFULL);
+#endif
+}
+
+// Multi-ISA build (-DFFP_DISPATCH): the hot kernels are cloned per ISA and the
+// loader picks one from CPUID before main runs
+#if defined(FFP_DISPATCH) && defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+  #define FFP_HOT __attribute__((target_clones("default","popcnt","arch=x86-64-v3")))
+#else
+  #define FFP_HOT
+#endif
+
+// Hot-path profiling (-DFFP_PROFILE): PROF_SCOPE(id) times the rest of the enclosing
+// block with the time-stamp counter (clock_gettime ns elsewhere) into thread-local
+// counters, which workers add to the process totals when they finish
+enum { PROF_MOVEGEN, PROF_LEGAL, PROF_MAKE, PROF_UNMAKE, PROF_ATTACKED, PROF_EVAL, PROF_COUNT };
+
+#ifdef FFP_PROFILE
+typedef struct { uint64_t calls[PROF_COUNT], ticks[PROF_COUNT]; } ProfCounters;
+typedef struct { int id; uint64_t t0; } ProfScope;
+
+static _Thread_local ProfCounters prof_local;
+static ProfCounters prof_total;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t prof_clock(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void prof_end(ProfScope *s){
+    prof_local.calls[s->id]++;
+    prof_local.ticks[s->id] += prof_clock() - s->t0;
+}
+
+static void prof_flush(void){
+    pthread_mutex_lock(&prof_lock);
+    for (int i=0;i<PROF_COUNT;i++){ prof_total.calls[i] += prof_local.calls[i]; prof_total.ticks[i] += prof_local.ticks[i]; }
+    pthread_mutex_unlock(&prof_lock);
+    memset(&prof_local, 0, sizeof(prof_local));
+}
+
+  #define PROF_SCOPE(id) ProfScope prof_scope_ __attribute__((cleanup(prof_end))) = { (id), prof_clock() }
+#else
+  #define PROF_SCOPE(id) ((void)0)
+#endif
+
 // Shifts (a8..h1)
 static inline U64 shift_east (U64 bb){ return (bb & ~FILE_H) << 1; }
 static inline U64 shift_west (U64 bb){ return (bb & ~FILE_A) >> 1; }
@@ -76,6 +164,57 @@ static inline void update_occupancy(Position *pos){
     pos->occ_all   = pos->occ_white | pos->occ_black;
 }
 
+// Zobrist keys (fixed seed so keys are stable across runs)
+static U64 ZOBRIST_PSQ[PIECE_N][64], ZOBRIST_CASTLE[16], ZOBRIST_EP[8], ZOBRIST_SIDE;
+static pthread_once_t zobrist_once = PTHREAD_ONCE_INIT;
+
+static inline U64 splitmix64(U64 *state){
+    U64 z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+    return z ^ (z>>31);
+}
+
+static void zobrist_init(void){
+    U64 seed = 0x46465021ULL;
+    for (int p=0;p<PIECE_N;p++) for (int s=0;s<64;s++) ZOBRIST_PSQ[p][s] = splitmix64(&seed);
+    for (int c=1;c<16;c++) ZOBRIST_CASTLE[c] = splitmix64(&seed); // no rights = 0
+    for (int f=0;f<8;f++) ZOBRIST_EP[f] = splitmix64(&seed);
+    ZOBRIST_SIDE = splitmix64(&seed);
+}
+
+static U64 compute_key(const Position *pos){
+    pthread_once(&zobrist_once, zobrist_init);
+    U64 k = ZOBRIST_CASTLE[pos->castling & 15];
+    for (int p=0;p<PIECE_N;p++) for (U64 b=pos->bb[p]; b; b&=b-1) k ^= ZOBRIST_PSQ[p][LSB_INDEX(b)];
+    if (pos->ep_square>=0) k ^= ZOBRIST_EP[pos->ep_square%8];
+    if (pos->side==BLACK) k ^= ZOBRIST_SIDE;
+    return k;
+}
+
+U64 ffp_position_key(const Position *pos){ return pos->key; }
+
+static inline int piece_on(const Position *pos, int sq){
+    if (!get_bit(pos->occ_all, sq)) return -1;
+    for (int p=0;p<PIECE_N;p++) if (get_bit(pos->bb[p],sq)) return p;
+    return -1;
+}
+
+// Colour flip: ranks reversed (byte swap), white and black exchanged
+void ffp_position_mirror(const Position *in, Position *out){
+    Position t = *in;
+    for (int p=0;p<6;p++){
+        t.bb[p] = bswap64(in->bb[p+6]);
+        t.bb[p+6] = bswap64(in->bb[p]);
+    }
+    t.side = in->side==WHITE ? BLACK : WHITE;
+    t.castling = (in->castling>>2 & 3) | (in->castling&3)<<2;
+    t.ep_square = in->ep_square>=0 ? in->ep_square^56 : -1;
+    update_occupancy(&t);
+    t.key = compute_key(&t);
+    *out = t;
+}
+
 // Attacks (independent)
 static inline U64 king_attacks_from(U64 src){
     U64 a=0; a |= shift_north(src)|shift_south(src)|shift_east(src)|shift_west(src);
@@ -106,7 +245,8 @@ static inline U64 bishop_attacks_from(U64 s,U64 o){return ray_ne(s,o)|ray_nw(s,o
 static inline U64 queen_attacks_from (U64 s,U64 o){return rook_attacks_from(s,o)|bishop_attacks_from(s,o);}
 
 // Attack test
-bool ffp_is_square_attacked(const Position *pos, int sq, Side by){
+FFP_HOT bool ffp_is_square_attacked(const Position *pos, int sq, Side by){
+    PROF_SCOPE(PROF_ATTACKED);
     U64 t = 1ULL<<sq, occ = pos->occ_all;
     if (by==WHITE){
         if (white_pawn_attacks(pos->bb[WP]) & t) return true;
@@ -130,7 +270,8 @@ static inline void add_move(MoveList *ml,int from,int to,int piece,int captured,
 }
 
 // Pseudo-legal generator
-void ffp_generate_pseudo_legal(const Position *pos, MoveList *ml){
+FFP_HOT void ffp_generate_pseudo_legal(const Position *pos, MoveList *ml){
+    PROF_SCOPE(PROF_MOVEGEN);
     ml->count = 0;
     const Side us = pos->side;
     const U64 own = (us==WHITE)? pos->occ_white : pos->occ_black;
@@ -204,22 +345,22 @@ void ffp_generate_pseudo_legal(const Position *pos, MoveList *ml){
         U64 capL = shift_sw(pawns) & opp, capR = shift_se(pawns) & opp;
         U64 promoL = capL & RANK_MASK(1), promoR = capR & RANK_MASK(1);
         U64 normL  = capL & ~RANK_MASK(1), normR  = capR & ~RANK_MASK(1);
-        for (U64 c=normL; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-9; int cap=-1;
+        for (U64 c=normL; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-7; int cap=-1;
             for (int p=WP;p<=WK;p++) if (get_bit(pos->bb[p],to)){ cap=p; break; }
             add_move(ml,from,to,BP,cap,-1,MF_CAPTURE);
         }
-        for (U64 c=normR; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-7; int cap=-1;
+        for (U64 c=normR; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-9; int cap=-1;
             for (int p=WP;p<=WK;p++) if (get_bit(pos->bb[p],to)){ cap=p; break; }
             add_move(ml,from,to,BP,cap,-1,MF_CAPTURE);
         }
-        for (U64 c=promoL; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-9; int cap=-1;
+        for (U64 c=promoL; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-7; int cap=-1;
             for (int p=WP;p<=WK;p++) if (get_bit(pos->bb[p],to)){ cap=p; break; }
             add_move(ml,from,to,BP,cap,BQ,MF_CAPTURE|MF_PROMO);
             add_move(ml,from,to,BP,cap,BR,MF_CAPTURE|MF_PROMO);
             add_move(ml,from,to,BP,cap,BB,MF_CAPTURE|MF_PROMO);
             add_move(ml,from,to,BP,cap,BN,MF_CAPTURE|MF_PROMO);
         }
-        for (U64 c=promoR; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-7; int cap=-1;
+        for (U64 c=promoR; c; c&=c-1){ int to=LSB_INDEX(c); int from=to-9; int cap=-1;
             for (int p=WP;p<=WK;p++) if (get_bit(pos->bb[p],to)){ cap=p; break; }
             add_move(ml,from,to,BP,cap,BQ,MF_CAPTURE|MF_PROMO);
             add_move(ml,from,to,BP,cap,BR,MF_CAPTURE|MF_PROMO);
@@ -228,8 +369,8 @@ void ffp_generate_pseudo_legal(const Position *pos, MoveList *ml){
         }
         if (pos->ep_square!=-1){
             U64 ep = 1ULL<<pos->ep_square;
-            if (shift_sw(pawns)&ep){ int to=pos->ep_square; int from=to-9; add_move(ml,from,to,BP,WP,-1,MF_ENPASSANT|MF_CAPTURE); }
-            if (shift_se(pawns)&ep){ int to=pos->ep_square; int from=to-7; add_move(ml,from,to,BP,WP,-1,MF_ENPASSANT|MF_CAPTURE); }
+            if (shift_sw(pawns)&ep){ int to=pos->ep_square; int from=to-7; add_move(ml,from,to,BP,WP,-1,MF_ENPASSANT|MF_CAPTURE); }
+            if (shift_se(pawns)&ep){ int to=pos->ep_square; int from=to-9; add_move(ml,from,to,BP,WP,-1,MF_ENPASSANT|MF_CAPTURE); }
         }
     }
 
@@ -373,18 +514,24 @@ void ffp_generate_pseudo_legal(const Position *pos, MoveList *ml){
 
 static inline void move_piece_bb(Position *pos,int piece,int from,int to){ pop_bit(&pos->bb[piece],from); set_bit(&pos->bb[piece],to); }
 
-void ffp_make_move(Position *pos, const Move m, Undo *u){
+FFP_HOT void ffp_make_move(Position *pos, const Move m, Undo *u){
+    PROF_SCOPE(PROF_MAKE);
     u->castling=pos->castling; u->ep_square=pos->ep_square; u->halfmove_clock=pos->halfmove_clock;
-    u->fullmove_number=pos->fullmove_number; u->captured=m.captured;
+    u->fullmove_number=pos->fullmove_number; u->captured=m.captured; u->key=pos->key;
+
+    U64 key = pos->key ^ ZOBRIST_SIDE ^ ZOBRIST_CASTLE[pos->castling]
+            ^ ZOBRIST_PSQ[m.piece][m.from] ^ ZOBRIST_PSQ[(m.flags & MF_PROMO) ? m.promo : m.piece][m.to];
+    if (pos->ep_square!=-1) key ^= ZOBRIST_EP[pos->ep_square%8];
 
     pos->halfmove_clock = (type_of_piece(m.piece)==0 || (m.flags&(MF_CAPTURE|MF_ENPASSANT))) ? 0 : pos->halfmove_clock+1;
     pos->ep_square = -1;
 
     if (m.flags & MF_ENPASSANT){
-        if (pos->side==WHITE) pop_bit(&pos->bb[BP], m.to+8);
-        else                  pop_bit(&pos->bb[WP], m.to-8);
+        if (pos->side==WHITE){ pop_bit(&pos->bb[BP], m.to+8); key ^= ZOBRIST_PSQ[BP][m.to+8]; }
+        else                 { pop_bit(&pos->bb[WP], m.to-8); key ^= ZOBRIST_PSQ[WP][m.to-8]; }
     } else if (m.captured!=-1){
         pop_bit(&pos->bb[m.captured], m.to);
+        key ^= ZOBRIST_PSQ[m.captured][m.to];
     }
 
     move_piece_bb(pos, m.piece, m.from, m.to);
@@ -396,11 +543,11 @@ void ffp_make_move(Position *pos, const Move m, Undo *u){
 
     if (m.flags & MF_CASTLE){
         if (m.piece==WK){
-            if (m.to==62){ pop_bit(&pos->bb[WR],63); set_bit(&pos->bb[WR],61); }
-            else if (m.to==58){ pop_bit(&pos->bb[WR],56); set_bit(&pos->bb[WR],59); }
+            if (m.to==62){ pop_bit(&pos->bb[WR],63); set_bit(&pos->bb[WR],61); key ^= ZOBRIST_PSQ[WR][63]^ZOBRIST_PSQ[WR][61]; }
+            else if (m.to==58){ pop_bit(&pos->bb[WR],56); set_bit(&pos->bb[WR],59); key ^= ZOBRIST_PSQ[WR][56]^ZOBRIST_PSQ[WR][59]; }
         } else if (m.piece==BK){
-            if (m.to==6){ pop_bit(&pos->bb[BR],7); set_bit(&pos->bb[BR],5); }
-            else if (m.to==2){ pop_bit(&pos->bb[BR],0); set_bit(&pos->bb[BR],3); }
+            if (m.to==6){ pop_bit(&pos->bb[BR],7); set_bit(&pos->bb[BR],5); key ^= ZOBRIST_PSQ[BR][7]^ZOBRIST_PSQ[BR][5]; }
+            else if (m.to==2){ pop_bit(&pos->bb[BR],0); set_bit(&pos->bb[BR],3); key ^= ZOBRIST_PSQ[BR][0]^ZOBRIST_PSQ[BR][3]; }
         }
     }
 
@@ -412,15 +559,18 @@ void ffp_make_move(Position *pos, const Move m, Undo *u){
     if (get_bit(1ULL<<m.from, 7)  || (m.captured==BR && m.to==7))  pos->castling &= ~4;
     if (get_bit(1ULL<<m.from, 0)  || (m.captured==BR && m.to==0))  pos->castling &= ~8;
 
-    if (m.flags & MF_DOUBLE) pos->ep_square = (pos->side==WHITE) ? (m.to+8) : (m.to-8);
+    if (m.flags & MF_DOUBLE){ pos->ep_square = (pos->side==WHITE) ? (m.to+8) : (m.to-8); key ^= ZOBRIST_EP[m.to%8]; }
+    pos->key = key ^ ZOBRIST_CASTLE[pos->castling];
 
     if (pos->side==BLACK) pos->fullmove_number++;
     pos->side = (Side)!pos->side;
     update_occupancy(pos);
 }
 
-void ffp_unmake_move(Position *pos, const Move m, const Undo *u){
+FFP_HOT void ffp_unmake_move(Position *pos, const Move m, const Undo *u){
+    PROF_SCOPE(PROF_UNMAKE);
     pos->castling=u->castling; pos->ep_square=u->ep_square; pos->halfmove_clock=u->halfmove_clock; pos->fullmove_number=u->fullmove_number;
+    pos->key=u->key;
     pos->side = (Side)!pos->side;
 
     pop_bit(&pos->bb[m.piece], m.to); set_bit(&pos->bb[m.piece], m.from);
@@ -452,6 +602,7 @@ void ffp_unmake_move(Position *pos, const Move m, const Undo *u){
 
 // Legal movegen (filter checks)
 void ffp_generate_legal(const Position *pos, MoveList *out){
+    PROF_SCOPE(PROF_LEGAL);
     MoveList ml; ffp_generate_pseudo_legal(pos,&ml);
     out->count=0;
     for (int i=0;i<ml.count;i++){
@@ -496,14 +647,27 @@ void ffp_position_clear(Position *pos){
     position_reset(pos);
 }
 
-bool ffp_position_from_fen(Position *pos, const char *fen){
+static inline bool is_blank(char c){ return c==' ' || c=='\t'; }
+static inline const char *skip_blanks(const char *p, const char *end){ while (p<end && is_blank(*p)) p++; return p; }
+
+// Unsigned decimal token; NULL if [p,end) does not start with one
+static const char *parse_uint(const char *p, const char *end, int *out){
+    if (p>=end || !isdigit((unsigned char)*p)) return NULL;
+    int v=0;
+    while (p<end && isdigit((unsigned char)*p)){ if (v<100000000) v = v*10 + (*p-'0'); p++; }
+    if (p<end && !is_blank(*p)) return NULL;
+    *out=v; return p;
+}
+
+// Bounded FEN parser: works on [p,end) so EPD lines can be parsed in place.
+// Clocks are optional and only consumed when numeric; *rest gets the first unparsed char.
+static bool parse_fen(Position *pos, const char *p, const char *end, const char **rest){
     position_reset(pos);
     int file=0, rank=7;
-    const char *p = fen;
 
     // Piece placement
-    while (*p && rank>=0){
-        if (*p==' ') break;
+    while (p<end && rank>=0){
+        if (is_blank(*p)) break;
         if (*p=='/'){ if (file!=8) return false; file=0; rank--; p++; continue; }
         if (isdigit((unsigned char)*p)){
             int n=*p-'0'; if (n<1 || n>8) return false;
@@ -519,24 +683,24 @@ bool ffp_position_from_fen(Position *pos, const char *fen){
         int sq = (7-rank)*8 + file;
         set_bit(&pos->bb[piece], sq);
         file++; p++;
-        if (file==8 && rank>0 && *p!='/' && *p!=' ') return false;
+        if (file==8 && rank>0 && p<end && *p!='/' && !is_blank(*p)) return false;
     }
     if (rank!=0 || file!=8) return false;
-    while (*p==' ') p++;
+    p = skip_blanks(p, end);
 
     // Side
-    if (*p=='w') pos->side=WHITE;
-    else if (*p=='b') pos->side=BLACK;
+    if (p<end && *p=='w') pos->side=WHITE;
+    else if (p<end && *p=='b') pos->side=BLACK;
     else return false;
     p++;
-    if (*p != ' ') { return false; }
-    p++;
+    if (p>=end || !is_blank(*p)) return false;
+    p = skip_blanks(p, end);
 
     // Castling
     pos->castling=0;
-    if (*p=='-'){ p++; }
+    if (p<end && *p=='-'){ p++; }
     else {
-        while (*p && *p!=' '){
+        while (p<end && !is_blank(*p)){
             if (*p=='K') pos->castling|=1;
             else if (*p=='Q') pos->castling|=2;
             else if (*p=='k') pos->castling|=4;
@@ -545,32 +709,39 @@ bool ffp_position_from_fen(Position *pos, const char *fen){
             p++;
         }
     }
-    if (*p!=' ') return false;
-    p++;
+    if (p>=end || !is_blank(*p)) return false;
+    p = skip_blanks(p, end);
 
-    // En passant
-    if (*p=='-'){ pos->ep_square=-1; p++; }
-    else {
-        if (p[0]>='a'&&p[0]<='h'&&p[1]>='1'&&p[1]<='8'){
-            int f=p[0]-'a', r=p[1]-'1';
-            pos->ep_square = r*8+f;
-            p+=2;
-        } else return false;
-    }
-    if (*p==' ') p++;
+    // En passant (a8=0: rank 8 is row 0)
+    if (p<end && *p=='-'){ pos->ep_square=-1; p++; }
+    else if (end-p>=2 && p[0]>='a'&&p[0]<='h'&&p[1]>='1'&&p[1]<='8'){
+        pos->ep_square = ('8'-p[1])*8 + (p[0]-'a');
+        p+=2;
+    } else return false;
+    if (p<end && !is_blank(*p)) return false;
 
     // Halfmove & fullmove (optional)
-    if (*p){ pos->halfmove_clock = atoi(p); while(*p&&*p!=' ') p++; if (*p==' ') p++; }
-    if (*p){ pos->fullmove_number= atoi(p); }
+    int n; const char *q = parse_uint(skip_blanks(p, end), end, &n);
+    if (q){
+        pos->halfmove_clock=n; p=q;
+        q = parse_uint(skip_blanks(p, end), end, &n);
+        if (q){ pos->fullmove_number=n; p=q; }
+    }
 
     update_occupancy(pos);
+    pos->key = compute_key(pos);
+    if (rest) *rest=p;
     return true;
 }
 
+bool ffp_position_from_fen(Position *pos, const char *fen){
+    return parse_fen(pos, fen, fen+strlen(fen), NULL);
+}
+
 const char *FFP_FEN_STARTPOS="rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
 void ffp_position_set_start(Position *pos){
-    ffp_position_from_fen(pos, FFP_FEN_STARTPOS);
+    set_from_fen(pos, NULL);
 }
 
 bool ffp_position_to_fen(const Position *pos, char *buffer, size_t length){
@@ -580,7 +751,7 @@ bool ffp_position_to_fen(const Position *pos, char *buffer, size_t length){
     for (int rank=7; rank>=0; --rank){
         int empty=0;
         for (int file=0; file<8; ++file){
-            int sq=rank*8+file;
+            int sq=(7-rank)*8+file;
             int piece=-1;
             for (int p=0; p<PIECE_N; ++p){
                 if (get_bit(pos->bb[p], sq)){ piece=p; break; }
@@ -611,7 +782,7 @@ bool ffp_position_to_fen(const Position *pos, char *buffer, size_t length){
         temp[idx++]='-';
     } else {
         temp[idx++]='a'+(pos->ep_square%8);
-        temp[idx++]='1'+(pos->ep_square/8);
+        temp[idx++]='8'-(pos->ep_square/8);
     }
     temp[idx++]=' ';
     idx += snprintf(temp+idx, sizeof(temp)-idx, "%d %d", pos->halfmove_clock, pos->fullmove_number);
@@ -622,8 +793,567 @@ bool ffp_position_to_fen(const Position *pos, char *buffer, size_t length){
     return true;
 }
 
+// Wall clock (clock() is process CPU time and adds up across threads)
+static double wall_seconds(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+// Time-stamp counter (reference cycles); 0 where there is none
+static inline uint64_t cycle_count(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Tracing (--trace FILE): complete ("X") and instant ("i") events go to a ring
+// buffer owned by the recording thread and are written as Chrome trace-event JSON
+// at exit; with tracing off every call site is a single branch on trace_on
+#define TRACE_RING 32768
+
+typedef struct {
+    uint64_t ts, dur;           // ns since trace start
+    const char *name, *arg_name;  // string literals
+    int64_t arg;
+    char text[8];               // optional short string argument ("move")
+    char ph;
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent ev[TRACE_RING];
+    uint64_t head;              // events recorded; the oldest are overwritten
+    int tid;
+    struct TraceRing *next;
+} TraceRing;
+
+static bool trace_on;
+static double trace_t0;
+static _Thread_local TraceRing *trace_ring;
+static _Atomic(TraceRing*) trace_rings;
+static atomic_int trace_tids;
+
+static inline uint64_t trace_now(void){ return trace_on ? (uint64_t)((wall_seconds()-trace_t0)*1e9) : 0; }
+
+static void trace_event(char ph, const char *name, uint64_t start, const char *arg_name, int64_t arg, const char *text){
+    TraceRing *r = trace_ring;
+    if (!r){
+        if (!(r = calloc(1, sizeof(TraceRing)))) return;
+        r->tid = atomic_fetch_add(&trace_tids, 1);
+        r->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &r->next, r)) {}
+        trace_ring = r;
+    }
+    uint64_t now = trace_now();
+    TraceEvent *e = &r->ev[r->head++ % TRACE_RING];
+    e->ph = ph; e->name = name; e->arg_name = arg_name; e->arg = arg;
+    e->ts = ph=='X' ? start : now;
+    e->dur = ph=='X' ? now-start : 0;
+    snprintf(e->text, sizeof(e->text), "%s", text ? text : "");
+}
+
+// Complete event from `start` (a trace_now() value) to now
+#define TRACE_SPAN(name, start, arg_name, arg) do { if (trace_on) trace_event('X', name, start, arg_name, arg, NULL); } while (0)
+#define TRACE_MARK(name, arg_name, arg) do { if (trace_on) trace_event('i', name, 0, arg_name, arg, NULL); } while (0)
+
+// Workers: run fn(worker, arg) on `threads` threads, worker 0 on the caller
+typedef void (*WorkerFn)(int worker, void *arg);
+typedef struct { WorkerFn fn; void *arg; int worker; } WorkerStart;
+
+static void run_worker(WorkerFn fn, int worker, void *arg){
+    uint64_t t0 = trace_now();
+    fn(worker, arg);
+    TRACE_SPAN("worker", t0, "worker", worker);
+}
+
+static void *worker_entry(void *p){
+    WorkerStart *w=(WorkerStart*)p;
+    run_worker(w->fn, w->worker, w->arg);
+#ifdef FFP_PROFILE
+    prof_flush();
+#endif
+    return NULL;
+}
+
+// One-off threads, for calls made while the pool is busy (nested or concurrent)
+static void spawn_workers(int threads, WorkerFn fn, void *arg){
+    pthread_t *tid = malloc(sizeof(pthread_t)*threads);
+    WorkerStart *ws = malloc(sizeof(WorkerStart)*threads);
+    bool *spawned = calloc(threads, sizeof(bool));
+    if (!tid || !ws || !spawned){
+        for (int i=0;i<threads;i++) run_worker(fn, i, arg);
+        free(tid); free(ws); free(spawned); return;
+    }
+    for (int i=1;i<threads;i++){
+        ws[i]=(WorkerStart){fn,arg,i};
+        spawned[i] = pthread_create(&tid[i], NULL, worker_entry, &ws[i])==0;
+    }
+    run_worker(fn, 0, arg);
+    for (int i=1;i<threads;i++){
+        if (spawned[i]) pthread_join(tid[i], NULL);
+        else run_worker(fn, i, arg); // could not spawn: run inline
+    }
+    free(tid); free(ws); free(spawned);
+}
+
+// Worker pools: threads are created on first use, then park on a condition variable
+// between jobs and keep their caches, thread-locals and CPU affinity. Pool thread
+// k always runs worker index k. The tools share one process-wide pool; every
+// FfpEngine owns its own.
+enum { AFFINITY_NONE, AFFINITY_CPU, AFFINITY_NODE };
+
+typedef struct {
+    pthread_mutex_t owner;      // held by the thread running a job on the pool
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    pthread_t *tid;
+    int size;                   // pool threads, worker indices 1..size
+    uint64_t generation;        // bumped for every job
+    int active;                 // worker indices taking part in the current job
+    int pending;                // pool threads still running it
+    WorkerFn fn;
+    void *arg;
+    int affinity;               // AFFINITY_*, applied by each thread before its next job
+    bool quit;
+} WorkerPool;
+
+#define WORKER_POOL_INIT { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, \
+                           NULL, 0, 0, 0, 0, NULL, NULL, AFFINITY_NONE, false }
+
+static WorkerPool shared_pool = WORKER_POOL_INIT;
+
+#ifdef __linux__
+// CPUs of NUMA node `node` from sysfs (what libnuma reads); false if there is no such node
+static bool node_cpus(int node, cpu_set_t *set){
+    char path[64], list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    bool ok = fgets(list, sizeof(list), f)!=NULL;
+    fclose(f);
+    CPU_ZERO(set);
+    for (char *p=list; ok && *p && *p!='\n'; ){
+        int a=(int)strtol(p, &p, 10), b=a;
+        if (*p=='-') b=(int)strtol(p+1, &p, 10);
+        for (int c=a;c<=b && c<CPU_SETSIZE;c++) CPU_SET(c, set);
+        if (*p==',') p++;
+        else break;
+    }
+    return ok && CPU_COUNT(set)>0;
+}
+
+static void apply_affinity(int worker, int mode){
+    cpu_set_t set;
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu<1) ncpu=1;
+    CPU_ZERO(&set);
+    if (mode==AFFINITY_CPU) CPU_SET(worker % ncpu, &set);
+    else if (mode==AFFINITY_NODE){
+        int nodes=0; cpu_set_t tmp;
+        while (nodes<1024 && node_cpus(nodes, &tmp)) nodes++;
+        if (!nodes || !node_cpus(worker % nodes, &set)) for (int c=0;c<ncpu;c++) CPU_SET(c, &set);
+    }
+    else for (int c=0;c<ncpu;c++) CPU_SET(c, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+#else
+static void apply_affinity(int worker, int mode){ (void)worker; (void)mode; }
+#endif
+
+typedef struct { WorkerPool *pool; int worker; } PoolStart;
+
+static void *pool_main(void *p){
+    WorkerPool *wp = ((PoolStart*)p)->pool;
+    int worker = ((PoolStart*)p)->worker, applied = AFFINITY_NONE;
+    free(p);
+    uint64_t seen = 0;
+    TRACE_MARK("thread start", "worker", worker);
+    pthread_mutex_lock(&wp->lock);
+    for (;;){
+        while (wp->generation==seen && !wp->quit) pthread_cond_wait(&wp->wake, &wp->lock);
+        if (wp->quit) break;
+        seen = wp->generation;
+        if (worker >= wp->active) continue;
+        WorkerFn fn = wp->fn; void *arg = wp->arg;
+        int affinity = wp->affinity;
+        pthread_mutex_unlock(&wp->lock);
+        if (affinity!=applied){ apply_affinity(worker, affinity); applied=affinity; }
+        run_worker(fn, worker, arg);
+#ifdef FFP_PROFILE
+        prof_flush();
+#endif
+        pthread_mutex_lock(&wp->lock);
+        if (--wp->pending==0) pthread_cond_signal(&wp->done);
+    }
+    pthread_mutex_unlock(&wp->lock);
+#ifdef FFP_PROFILE
+    prof_flush();
+#endif
+    return NULL;
+}
+
+// Caller holds wp->owner
+static void pool_grow(WorkerPool *wp, int size){
+    if (size <= wp->size) return;
+    pthread_t *tid = realloc(wp->tid, sizeof(pthread_t)*size);
+    if (!tid) return;
+    wp->tid = tid;
+    while (wp->size < size){
+        PoolStart *ps = malloc(sizeof(PoolStart));
+        if (!ps) break;
+        *ps = (PoolStart){ wp, wp->size+1 };
+        if (pthread_create(&wp->tid[wp->size], NULL, pool_main, ps)!=0){ free(ps); break; }
+        wp->size++;
+    }
+}
+
+// Starts pool threads ahead of the first job (UCI Threads) and sets their affinity
+static void pool_reserve(WorkerPool *wp, int threads, int affinity){
+    pthread_mutex_lock(&wp->owner);
+    pool_grow(wp, threads-1);
+    pthread_mutex_lock(&wp->lock);
+    wp->affinity = affinity;
+    pthread_mutex_unlock(&wp->lock);
+    pthread_mutex_unlock(&wp->owner);
+}
+
+// Stops and joins the threads; the pool can be grown again afterwards
+static void pool_shutdown(WorkerPool *wp){
+    pthread_mutex_lock(&wp->owner);
+    pthread_mutex_lock(&wp->lock);
+    wp->quit = true;
+    pthread_cond_broadcast(&wp->wake);
+    pthread_mutex_unlock(&wp->lock);
+    for (int i=0;i<wp->size;i++) pthread_join(wp->tid[i], NULL);
+    free(wp->tid);
+    wp->tid = NULL; wp->size = 0; wp->quit = false;
+    pthread_mutex_unlock(&wp->owner);
+}
+
+// Runs fn(worker, arg) for worker = 0..threads-1, worker 0 on the caller
+static void pool_run(WorkerPool *wp, int threads, WorkerFn fn, void *arg){
+    if (threads<=1){ run_worker(fn, 0, arg); return; }
+    if (pthread_mutex_trylock(&wp->owner)!=0){ spawn_workers(threads, fn, arg); return; }
+    pool_grow(wp, threads-1);
+    pthread_mutex_lock(&wp->lock);
+    wp->fn = fn; wp->arg = arg;
+    wp->active = threads < wp->size+1 ? threads : wp->size+1;
+    wp->pending = wp->active-1;
+    wp->generation++;
+    int active = wp->active;
+    pthread_cond_broadcast(&wp->wake);
+    pthread_mutex_unlock(&wp->lock);
+    run_worker(fn, 0, arg);
+    for (int i=active;i<threads;i++) run_worker(fn, i, arg);  // more workers than pool threads: run inline
+    pthread_mutex_lock(&wp->lock);
+    while (wp->pending) pthread_cond_wait(&wp->done, &wp->lock);
+    pthread_mutex_unlock(&wp->lock);
+    pthread_mutex_unlock(&wp->owner);
+}
+
+static void run_workers(int threads, WorkerFn fn, void *arg){ pool_run(&shared_pool, threads, fn, arg); }
+
+// Mapped files (read-only; falls back to reading into memory for pipes etc.)
+bool ffp_file_map(MappedFile *file, const char *path){
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY);
+    if (fd<0) return false;
+    struct stat st;
+    if (fstat(fd, &st)==0 && S_ISREG(st.st_mode)){
+        file->size = (size_t)st.st_size;
+        if (file->size==0){ close(fd); return true; }
+        void *m = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m!=MAP_FAILED){
+            posix_madvise(m, file->size, POSIX_MADV_SEQUENTIAL);
+            file->data=(const char*)m; file->mapped=true;
+            close(fd); return true;
+        }
+    }
+    size_t cap=1<<20, len=0; char *buf=malloc(cap);
+    for (;;){
+        if (!buf){ close(fd); return false; }
+        if (len==cap){ char *nb=realloc(buf, cap*=2); if (!nb){ free(buf); buf=NULL; continue; } buf=nb; }
+        ssize_t r = read(fd, buf+len, cap-len);
+        if (r<0){ free(buf); close(fd); return false; }
+        if (r==0) break;
+        len += (size_t)r;
+    }
+    close(fd);
+    file->data=buf; file->size=len; file->mapped=false;
+    return true;
+}
+
+void ffp_file_unmap(MappedFile *file){
+    if (!file || !file->data) return;
+    if (file->mapped) munmap((void*)file->data, file->size);
+    else free((void*)file->data);
+    memset(file, 0, sizeof(*file));
+}
+
+// EPD
+static void parse_epd_ops(EpdRecord *rec, const char *p, const char *end){
+    rec->op_count=0;
+    for (;;){
+        p = skip_blanks(p, end);
+        if (p>=end) break;
+        const char *name=p;
+        while (p<end && !is_blank(*p) && *p!=';') p++;
+        int name_len=(int)(p-name);
+        p = skip_blanks(p, end);
+        const char *value=p; bool quoted=false;
+        while (p<end && (quoted || *p!=';')){ if (*p=='"') quoted=!quoted; p++; }
+        const char *vend=p;
+        if (p<end) p++; // ';'
+        while (vend>value && is_blank(vend[-1])) vend--;
+        if (vend-value>=2 && *value=='"' && vend[-1]=='"' && !memchr(value+1, '"', (size_t)(vend-value-2))){ value++; vend--; }
+        int value_len=(int)(vend-value), n;
+        if (name_len==4 && !memcmp(name,"hmvc",4) && parse_uint(value, vend, &n)) rec->pos.halfmove_clock=n;
+        if (name_len==4 && !memcmp(name,"fmvn",4) && parse_uint(value, vend, &n)) rec->pos.fullmove_number=n;
+        if (name_len>0 && rec->op_count<FFP_EPD_MAX_OPS)
+            rec->ops[rec->op_count++] = (EpdOp){name, value, name_len, value_len};
+    }
+}
+
+bool ffp_epd_parse_line(const char *line, size_t len, EpdRecord *rec){
+    const char *end=line+len, *rest;
+    rec->line=line; rec->line_len=len; rec->op_count=0;
+    if (!parse_fen(&rec->pos, skip_blanks(line, end), end, &rest)) return false;
+    parse_epd_ops(rec, rest, end);
+    return true;
+}
+
+const EpdOp *ffp_epd_find_op(const EpdRecord *rec, const char *name){
+    size_t n=strlen(name);
+    for (int i=0;i<rec->op_count;i++)
+        if ((size_t)rec->ops[i].name_len==n && !memcmp(rec->ops[i].name, name, n)) return &rec->ops[i];
+    return NULL;
+}
+
+bool ffp_epd_next(const char *data, size_t size, size_t *cursor, EpdRecord *rec, uint64_t *errors){
+    while (*cursor < size){
+        const char *line = data + *cursor;
+        const char *nl = memchr(line, '\n', size - *cursor);
+        size_t len = nl ? (size_t)(nl-line) : size - *cursor;
+        size_t offset = *cursor;
+        *cursor += len + (nl?1:0);
+        if (len && line[len-1]=='\r') len--;
+        const char *p = skip_blanks(line, line+len);
+        if (p==line+len || *p=='#') continue;
+        if (ffp_epd_parse_line(line, len, rec)){ rec->offset=offset; return true; }
+        if (errors) (*errors)++;
+    }
+    return false;
+}
+
+int ffp_epd_split(const char *data, size_t size, int parts, size_t *bounds){
+    if (parts<1) parts=1;
+    bounds[0]=0;
+    for (int i=1;i<parts;i++){
+        size_t b = size/parts*i;
+        if (b<bounds[i-1]) b=bounds[i-1];
+        const char *nl = b<size ? memchr(data+b, '\n', size-b) : NULL;
+        bounds[i] = nl ? (size_t)(nl-data)+1 : size;
+    }
+    bounds[parts]=size;
+    return parts;
+}
+
+typedef struct {
+    const char *data;
+    size_t *bounds;
+    EpdCallback cb;
+    void *user;
+    volatile bool stop;
+    uint64_t *records, *errors;
+} EpdJob;
+
+static void epd_worker(int worker, void *arg){
+    EpdJob *job=(EpdJob*)arg;
+    EpdRecord rec; rec.worker=worker;
+    size_t cursor=job->bounds[worker];
+    while (!job->stop && ffp_epd_next(job->data, job->bounds[worker+1], &cursor, &rec, &job->errors[worker])){
+        job->records[worker]++;
+        if (job->cb && !job->cb(&rec, job->user)) job->stop=true;
+    }
+}
+
+bool ffp_epd_load(const char *path, int threads, EpdCallback cb, void *user, EpdStats *stats){
+    MappedFile file;
+    if (!ffp_file_map(&file, path)) return false;
+    // Small inputs are not worth a thread each
+    int parts = threads<1 ? 1 : threads;
+    if ((size_t)parts > file.size/65536+1) parts = (int)(file.size/65536+1);
+    size_t *bounds = malloc(sizeof(size_t)*(parts+1));
+    uint64_t *counts = calloc(2*(size_t)parts, sizeof(uint64_t));
+    if (!bounds || !counts){ free(bounds); free(counts); ffp_file_unmap(&file); return false; }
+    ffp_epd_split(file.data, file.size, parts, bounds);
+
+    EpdJob job = { file.data, bounds, cb, user, false, counts, counts+parts };
+    double t0 = wall_seconds();
+    run_workers(parts, epd_worker, &job);
+    if (stats){
+        memset(stats, 0, sizeof(*stats));
+        for (int i=0;i<parts;i++){ stats->records += job.records[i]; stats->errors += job.errors[i]; }
+        stats->bytes = file.size;
+        stats->seconds = wall_seconds()-t0;
+    }
+    free(bounds); free(counts);
+    ffp_file_unmap(&file);
+    return true;
+}
+
+// Packed positions: 32 bytes, little endian
+//   0..7   occupancy (a8=bit0)
+//   8..23  4-bit piece codes of the occupied squares in square order, low nibble first
+//   24..27 side | castling<<1 | (ep file+1)<<5 | halfmove<<9 | fullmove<<16 | result<<28 | has_score<<30
+//   28..29 score, 30..31 move (ffp_move_pack)
+static inline void put_le(uint8_t *p, uint64_t v, int n){ for (int i=0;i<n;i++) p[i]=(uint8_t)(v>>(8*i)); }
+static inline uint64_t get_le(const uint8_t *p, int n){ uint64_t v=0; for (int i=0;i<n;i++) v|=(uint64_t)p[i]<<(8*i); return v; }
+
+bool ffp_position_pack(const Position *pos, const PackedInfo *info, PackedPosition *out){
+    U64 occ = pos->occ_all;
+    if (popcount64(occ) > 32) return false;
+    memset(out, 0, sizeof(*out));
+    uint8_t *b = out->bytes;
+    put_le(b, occ, 8);
+    for (int p=0;p<PIECE_N;p++){
+        for (U64 x=pos->bb[p]; x; x&=x-1){
+            int i = popcount64(occ & ((1ULL<<LSB_INDEX(x))-1));
+            b[8+i/2] |= (uint8_t)(p << (4*(i&1)));
+        }
+    }
+    int hm = pos->halfmove_clock<0 ? 0 : pos->halfmove_clock>127 ? 127 : pos->halfmove_clock;
+    int fm = pos->fullmove_number<0 ? 0 : pos->fullmove_number>4095 ? 4095 : pos->fullmove_number;
+    uint32_t state = (pos->side==WHITE) | (uint32_t)(pos->castling&15)<<1
+                   | (uint32_t)(pos->ep_square<0 ? 0 : pos->ep_square%8+1)<<5
+                   | (uint32_t)hm<<9 | (uint32_t)fm<<16;
+    if (info){
+        state |= (uint32_t)(info->result&3)<<28 | (uint32_t)(info->has_score?1:0)<<30;
+        put_le(b+28, (uint16_t)info->score, 2);
+        put_le(b+30, info->move, 2);
+    }
+    put_le(b+24, state, 4);
+    return true;
+}
+
+bool ffp_position_unpack(const PackedPosition *in, Position *pos, PackedInfo *info){
+    const uint8_t *b = in->bytes;
+    position_reset(pos);
+    U64 occ = get_le(b, 8);
+    if (popcount64(occ) > 32) return false;
+    int i=0;
+    for (U64 x=occ; x; x&=x-1, i++){
+        int p = (b[8+i/2] >> (4*(i&1))) & 15;
+        if (p>=PIECE_N) return false;
+        set_bit(&pos->bb[p], LSB_INDEX(x));
+    }
+    uint32_t state = (uint32_t)get_le(b+24, 4);
+    pos->side = (state&1) ? WHITE : BLACK;
+    pos->castling = (state>>1)&15;
+    int ep = (state>>5)&15;
+    if (ep>8) return false;
+    pos->ep_square = ep ? ((pos->side==WHITE) ? 16 : 40) + ep-1 : -1;
+    pos->halfmove_clock = (state>>9)&127;
+    pos->fullmove_number = (state>>16)&4095;
+    if (info){
+        info->result = (state>>28)&3;
+        info->has_score = (state>>30)&1;
+        info->score = (int16_t)get_le(b+28, 2);
+        info->move = (uint16_t)get_le(b+30, 2);
+    }
+    update_occupancy(pos);
+    pos->key = compute_key(pos);
+    return true;
+}
+
+uint16_t ffp_move_pack(const Move *move){
+    if (!move || move->from<0 || move->to<0) return 0;
+    int promo = (move->flags & MF_PROMO) ? type_of_piece(move->promo) : 0;
+    return (uint16_t)(move->from | move->to<<6 | promo<<12);
+}
+
+// Rebuilds the full Move from the board without generating moves; no legality check
+bool ffp_move_unpack(const Position *pos, uint16_t packed, Move *out){
+    if (!packed) return false;
+    int from=packed&63, to=(packed>>6)&63, promo=(packed>>12)&7;
+    int piece=piece_on(pos, from), cap=piece_on(pos, to);
+    if (piece<0 || (piece<BP)!=(pos->side==WHITE)) return false;
+    if (cap>=0 && (cap<BP)==(piece<BP)) return false;
+    if (promo>4) return false;
+    Move m = {from, to, piece, -1, cap, cap>=0 ? MF_CAPTURE : MF_QUIET};
+    int t = type_of_piece(piece);
+    if (t==0){
+        if (to==pos->ep_square && cap<0 && from%8!=to%8){ m.captured = piece==WP ? BP : WP; m.flags = MF_ENPASSANT|MF_CAPTURE; }
+        if (abs(to-from)==16) m.flags |= MF_DOUBLE;
+        if (promo){ m.promo = (piece==WP ? WP : BP) + promo; m.flags |= MF_PROMO; }
+    } else if (promo) return false;
+    if (t==5 && abs(to-from)==2) m.flags = MF_CASTLE;
+    *out = m;
+    return true;
+}
+
+bool ffp_packed_reader_open(PackedReader *r, const char *path){
+    memset(r, 0, sizeof(*r));
+    if (!ffp_file_map(&r->file, path)) return false;
+    if (r->file.size % FFP_PACKED_SIZE){ ffp_file_unmap(&r->file); return false; }
+    r->records = (const PackedPosition*)r->file.data;
+    r->count = r->file.size / FFP_PACKED_SIZE;
+    return true;
+}
+
+bool ffp_packed_reader_next(PackedReader *r, Position *pos, PackedInfo *info){
+    while (r->cursor < r->count){
+        if (ffp_position_unpack(&r->records[r->cursor++], pos, info)) return true;
+    }
+    return false;
+}
+
+void ffp_packed_reader_close(PackedReader *r){
+    ffp_file_unmap(&r->file);
+    memset(r, 0, sizeof(*r));
+}
+
+#define PACKED_WRITER_RECORDS 32768  // 1 MB buffer
+
+bool ffp_packed_writer_open(PackedWriter *w, const char *path){
+    memset(w, 0, sizeof(*w));
+    w->buf = malloc(sizeof(PackedPosition)*PACKED_WRITER_RECORDS);
+    if (!w->buf) return false;
+    w->fp = fopen(path, "wb");
+    if (!w->fp){ free(w->buf); w->buf=NULL; return false; }
+    return true;
+}
+
+static bool packed_writer_flush(PackedWriter *w){
+    if (w->used && fwrite(w->buf, sizeof(PackedPosition), w->used, w->fp)!=w->used) w->failed=true;
+    w->used=0;
+    return !w->failed;
+}
+
+bool ffp_packed_writer_write(PackedWriter *w, const PackedPosition *rec, size_t count){
+    while (count){
+        if (w->used==PACKED_WRITER_RECORDS && !packed_writer_flush(w)) return false;
+        size_t n = PACKED_WRITER_RECORDS - w->used;
+        if (n>count) n=count;
+        memcpy(w->buf+w->used, rec, n*sizeof(PackedPosition));
+        w->used+=n; w->written+=n; rec+=n; count-=n;
+    }
+    return !w->failed;
+}
+
+bool ffp_packed_writer_close(PackedWriter *w){
+    if (!w->fp) return false;
+    packed_writer_flush(w);
+    if (fclose(w->fp)!=0) w->failed=true;
+    free(w->buf);
+    bool ok=!w->failed;
+    memset(w, 0, sizeof(*w));
+    return ok;
+}
+
 // Perft
-static uint64_t perft(Position *pos, int depth){
+static FFP_HOT uint64_t perft(Position *pos, int depth){
     if (depth==0) return 1ULL;
     MoveList ml; ffp_generate_legal(pos,&ml);
     uint64_t nodes=0;
@@ -636,68 +1366,393 @@ static uint64_t perft(Position *pos, int depth){
 }
 
 // Eval/Search
-static const int PIECE_VAL[6]={100,500,320,330,900,20000};
+// The evaluation is linear in ffp_eval_params: score = sum(param[i] * feature[i])
+// from white's point of view, which is what the tuner relies on.
+int ffp_eval_params[FFP_EVAL_PARAMS]={100,500,320,330,900};
+
+static inline void eval_features(const Position *pos, int8_t f[FFP_EVAL_PARAMS]){
+    for (int i=0;i<FFP_EVAL_PARAMS;i++) f[i] = (int8_t)(popcount64(pos->bb[i]) - popcount64(pos->bb[i+6]));
+}
 
 static int evaluate(const Position *pos){
+    PROF_SCOPE(PROF_EVAL);
     int s=0;
-    s += popcount64(pos->bb[WP])*PIECE_VAL[0] + popcount64(pos->bb[WR])*PIECE_VAL[1]
-       + popcount64(pos->bb[WN])*PIECE_VAL[2] + popcount64(pos->bb[WB])*PIECE_VAL[3]
-       + popcount64(pos->bb[WQ])*PIECE_VAL[4];
-    s -= popcount64(pos->bb[BP])*PIECE_VAL[0] + popcount64(pos->bb[BR])*PIECE_VAL[1]
-       + popcount64(pos->bb[BN])*PIECE_VAL[2] + popcount64(pos->bb[BB])*PIECE_VAL[3]
-       + popcount64(pos->bb[BQ])*PIECE_VAL[4];
+    for (int i=0;i<FFP_EVAL_PARAMS;i++) s += (popcount64(pos->bb[i]) - popcount64(pos->bb[i+6])) * ffp_eval_params[i];
     return (pos->side==WHITE) ? s : -s;
 }
 
+int ffp_evaluate(const Position *pos){ return evaluate(pos); }
+
+// Transposition table. Threads share it without locks: an entry stores its data
+// word and key^data, so a probe that reads halves of two different writes fails
+// the key check instead of returning a torn entry
+struct HashEntry {
+    _Atomic U64 check;          // key ^ data
+    _Atomic U64 data;           // HashData
+};
+
+typedef struct {
+    int16_t score;
+    uint16_t move;              // ffp_move_pack encoding
+    int8_t depth;
+    uint8_t bound;
+} HashData;
+
+enum { BOUND_NONE, BOUND_UPPER, BOUND_LOWER, BOUND_EXACT };
+
+// Tables are mapped, not malloc'ed: explicit 2 MB pages when the system has some
+// reserved (MAP_HUGETLB), else a 2 MB aligned mapping with transparent huge pages
+// requested, so probes do not miss the TLB on every access. Fresh mappings are
+// zero and untouched; pages land on the NUMA node of the thread that first
+// writes them, which ffp_hash_clear_parallel spreads over the workers.
+#define HUGE_PAGE ((size_t)2<<20)
+
+// Entry count (a power of two) and mapped size for mb megabytes
+static size_t hash_size(size_t mb, size_t *bytes){
+    size_t n = 1;
+    while (n*2*sizeof(HashEntry) <= mb*1024*1024) n*=2;
+    *bytes = (n*sizeof(HashEntry) + HUGE_PAGE-1) & ~(HUGE_PAGE-1);
+    return n;
+}
+
+// Maps bytes at a 2 MB aligned address: anonymous with fd<0, else the shared object fd
+static void *map_aligned(size_t bytes, int fd){
+    uint8_t *raw = mmap(NULL, bytes+HUGE_PAGE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (raw==MAP_FAILED) return NULL;
+    uint8_t *al = (uint8_t*)(((uintptr_t)raw + HUGE_PAGE-1) & ~(uintptr_t)(HUGE_PAGE-1));
+    void *p = fd<0 ? mmap(al, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0)
+                   : mmap(al, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0);
+    if (p==MAP_FAILED){ munmap(raw, bytes+HUGE_PAGE); return NULL; }
+    if (al>raw) munmap(raw, al-raw);
+    munmap(al+bytes, raw+HUGE_PAGE-al);
+    return al;
+}
+
+static int advise_huge(void *p, size_t bytes){
+#ifdef MADV_HUGEPAGE
+    if (madvise(p, bytes, MADV_HUGEPAGE)==0) return FFP_PAGES_TRANSPARENT;
+#endif
+    (void)p; (void)bytes;
+    return FFP_PAGES_NORMAL;
+}
+
+bool ffp_hash_init(HashTable *tt, size_t mb){
+    memset(tt, 0, sizeof(*tt));
+    size_t bytes, n = hash_size(mb, &bytes);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p!=MAP_FAILED) tt->pages = FFP_PAGES_HUGETLB;
+#endif
+    if (p==MAP_FAILED){
+        if (!(p = map_aligned(bytes, -1))) return false;
+        tt->pages = advise_huge(p, bytes);
+    }
+    tt->entries = p;
+    tt->bytes = bytes;
+    tt->mask = n-1;
+    TRACE_MARK("hash alloc", "entries", (int64_t)n);
+    return true;
+}
+
+// Shared tables are named POSIX shared-memory objects: a header in the first
+// 2 MB, then the entries. The process that wins O_CREAT|O_EXCL sizes the object
+// and publishes the header by storing the magic last; the others wait for the
+// magic, take the creator's size and count themselves in, and the last one to
+// detach unlinks the name. Probes and stores use the same key^data check as
+// threads do, so processes need no further coordination.
+#define SHARED_HASH_MAGIC 0x3168736168706666ULL     // "ffphash1"
+#define SHARED_HASH_NAME 64
+#define SHARED_HASH_WAIT_MS 2000
+
+typedef struct {
+    _Atomic uint64_t magic;
+    uint64_t bytes, entries;    // entry area, as in HashTable
+    atomic_int users;           // attached HashTables; 0 = being removed
+    char name[SHARED_HASH_NAME];
+} SharedHashHeader;
+
+static void sleep_ms(int ms){
+    struct timespec ts = { ms/1000, (long)(ms%1000)*1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// Waits for the creator to size the object and publish the header. NULL with
+// errno ESTALE when no header appears in time (the creator died before
+// publishing it, and the name stays taken until removed), EINVAL for an object
+// that is not an ffp table.
+static SharedHashHeader *shared_hash_header(int fd){
+    struct stat st;
+    SharedHashHeader *h = NULL;
+    int err = ESTALE;
+    for (int ms=0; ms<SHARED_HASH_WAIT_MS; ms++, sleep_ms(1)){
+        if (!h){
+            if (fstat(fd, &st)!=0) return NULL;
+            if ((size_t)st.st_size<HUGE_PAGE) continue;
+            if ((h = mmap(NULL, sizeof(*h), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))==MAP_FAILED) return NULL;
+        }
+        uint64_t magic = atomic_load_explicit(&h->magic, memory_order_acquire);
+        if (magic==SHARED_HASH_MAGIC && fstat(fd, &st)==0 && (size_t)st.st_size==HUGE_PAGE+h->bytes) return h;
+        if (magic){ err = EINVAL; break; }
+    }
+    if (h) munmap(h, sizeof(*h));
+    errno = err;
+    return NULL;
+}
+
+bool ffp_hash_attach(HashTable *tt, const char *name, size_t mb){
+    memset(tt, 0, sizeof(*tt));
+    char path[SHARED_HASH_NAME];
+    if (!name || !*name || strchr(name+(*name=='/'), '/')) return false;
+    if (snprintf(path, sizeof(path), "%s%s", *name=='/' ? "" : "/", name)>=(int)sizeof(path)) return false;
+    size_t bytes, n = hash_size(mb, &bytes);
+    // A few rounds cover losing the race against a process that is just removing the name
+    for (int round=0; round<100; round++){
+        int fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+        uint8_t *seg;
+        if (fd>=0){
+            if (ftruncate(fd, (off_t)(HUGE_PAGE+bytes))!=0 || !(seg = map_aligned(HUGE_PAGE+bytes, fd))){
+                close(fd); shm_unlink(path); return false;
+            }
+            close(fd);
+            SharedHashHeader *h = (SharedHashHeader*)seg;
+            h->bytes = bytes;
+            h->entries = n;
+            atomic_init(&h->users, 1);
+            snprintf(h->name, sizeof(h->name), "%s", path);
+            atomic_store_explicit(&h->magic, SHARED_HASH_MAGIC, memory_order_release);
+        } else {
+            if (errno!=EEXIST) return false;
+            if ((fd = shm_open(path, O_RDWR, 0))<0){ if (errno==ENOENT) continue; return false; }
+            SharedHashHeader *h = shared_hash_header(fd);
+            if (!h){ int err=errno; close(fd); errno=err; return false; }
+            bytes = h->bytes; n = h->entries;
+            munmap(h, sizeof(*h));
+            seg = n && !(n & (n-1)) && n*sizeof(HashEntry)<=bytes ? map_aligned(HUGE_PAGE+bytes, fd) : NULL;
+            close(fd);
+            if (!seg) return false;
+            h = (SharedHashHeader*)seg;
+            int users = atomic_load(&h->users);
+            while (users>0 && !atomic_compare_exchange_weak(&h->users, &users, users+1)) {}
+            if (users<=0){ munmap(seg, HUGE_PAGE+bytes); sleep_ms(1); continue; }
+        }
+        tt->segment = seg;
+        tt->entries = (HashEntry*)(seg+HUGE_PAGE);
+        tt->bytes = bytes;
+        tt->mask = n-1;
+        tt->pages = advise_huge(tt->entries, bytes);
+        TRACE_MARK("hash attach", "entries", (int64_t)n);
+        return true;
+    }
+    return false;
+}
+
+void ffp_hash_free(HashTable *tt){
+    if (!tt) return;
+    if (tt->segment){
+        SharedHashHeader *h = tt->segment;
+        if (atomic_fetch_sub(&h->users, 1)==1) shm_unlink(h->name);
+        munmap(tt->segment, HUGE_PAGE+tt->bytes);
+    } else if (tt->entries) munmap(tt->entries, tt->bytes);
+    memset(tt, 0, sizeof(*tt));
+}
+
+void ffp_hash_clear(HashTable *tt){
+    if (tt && tt->entries) memset(tt->entries, 0, (tt->mask+1)*sizeof(HashEntry));
+}
+
+typedef struct { HashTable *tt; int parts; } HashClearJob;
+
+static void hash_clear_worker(int worker, void *arg){
+    HashClearJob *job=(HashClearJob*)arg;
+    size_t pages = job->tt->bytes/HUGE_PAGE;    // split on page boundaries
+    size_t a = pages*worker/job->parts, b = pages*(worker+1)/job->parts;
+    memset((uint8_t*)job->tt->entries + a*HUGE_PAGE, 0, (b-a)*HUGE_PAGE);
+}
+
+// Engines clear on their own pool, so its affinity decides where the pages land
+static void hash_clear_on(WorkerPool *wp, HashTable *tt, int threads){
+    if (!tt || !tt->entries) return;
+    if (threads<=1 || tt->bytes<=HUGE_PAGE){ ffp_hash_clear(tt); return; }
+    HashClearJob job = { tt, threads };
+    pool_run(wp, threads, hash_clear_worker, &job);
+}
+
+void ffp_hash_clear_parallel(HashTable *tt, int threads){ hash_clear_on(&shared_pool, tt, threads); }
+
+const char *ffp_hash_pages(const HashTable *tt){
+    switch (tt->pages){
+        case FFP_PAGES_HUGETLB: return "2 MB pages (MAP_HUGETLB)";
+        case FFP_PAGES_TRANSPARENT: return "transparent huge pages (madvise)";
+        default: return "base pages";
+    }
+}
+
+#define MATE_SCORE 20000
+#define MATE_BOUND (MATE_SCORE-FFP_MAX_PLY)
+
+// Mate scores are stored relative to the node, not the root
+static inline int score_to_tt(int s, int ply){ return s>=MATE_BOUND ? s+ply : s<=-MATE_BOUND ? s-ply : s; }
+static inline int score_from_tt(int s, int ply){ return s>=MATE_BOUND ? s-ply : s<=-MATE_BOUND ? s+ply : s; }
+
+static inline void hash_store(HashEntry *e, U64 key, int depth, int bound, int score, uint16_t move){
+    HashData d = { (int16_t)score, move, (int8_t)depth, (uint8_t)bound };
+    U64 w = 0; memcpy(&w, &d, sizeof(d));
+    atomic_store_explicit(&e->check, key^w, memory_order_relaxed);
+    atomic_store_explicit(&e->data, w, memory_order_relaxed);
+}
+
+static inline bool hash_probe(HashEntry *e, U64 key, HashData *out){
+    U64 w = atomic_load_explicit(&e->data, memory_order_relaxed);
+    if ((atomic_load_explicit(&e->check, memory_order_relaxed) ^ w) != key) return false;
+    memcpy(out, &w, sizeof(*out));
+    return true;
+}
+
 typedef struct {
     uint64_t nodes;
-    clock_t start;
+    double start;
     SearchLimits limits;
+    HashTable *hash;
     bool aborted;
+    int helper;                 // Lazy SMP helper index, 0 = main thread
+    _Atomic uint64_t *smp_nodes;    // Lazy SMP: helpers add their nodes as they go, the main thread reports them
+    uint64_t smp_flushed;       // helper: nodes already added to smp_nodes
+    int pv_len[FFP_MAX_PLY];
+    Move pv[FFP_MAX_PLY][FFP_MAX_PLY];
+#ifdef FFP_STATS
+    SearchStats stats;          // This search only, added to limits.stats at the end
+    SearchDepthStats *st;       // Current iteration
+#endif
 } SearchContext;
 
+// Search statistics (-DFFP_STATS); the macros compile to nothing otherwise
+#ifdef FFP_STATS
+  #define STAT_INC(ctx, field) ((ctx)->st->field++)
+  #define STAT_PLY(ctx, ply) do { if ((ply)>(ctx)->st->seldepth) (ctx)->st->seldepth=(ply); } while (0)
+#else
+  #define STAT_INC(ctx, field) ((void)0)
+  #define STAT_PLY(ctx, ply) ((void)0)
+#endif
+
+void ffp_search_stats_merge(SearchStats *into, const SearchStats *from){
+    for (int d=1; d<=from->depths; d++){
+        SearchDepthStats *a=&into->depth[d]; const SearchDepthStats *b=&from->depth[d];
+        a->nodes += b->nodes;
+        a->tt_probes += b->tt_probes; a->tt_hits += b->tt_hits; a->tt_cutoffs += b->tt_cutoffs;
+        a->cutoffs += b->cutoffs; a->first_cutoffs += b->first_cutoffs;
+        if (b->seldepth > a->seldepth) a->seldepth = b->seldepth;
+    }
+    if (from->depths > into->depths) into->depths = from->depths;
+}
+
+// Helpers publish their node count every 1024 nodes and when they finish
+static void smp_flush_nodes(SearchContext *ctx){
+    atomic_fetch_add_explicit(ctx->smp_nodes, ctx->nodes-ctx->smp_flushed, memory_order_relaxed);
+    ctx->smp_flushed = ctx->nodes;
+}
+
+// Nodes of the whole search so far: the main thread's plus what the helpers published
+static uint64_t search_nodes(const SearchContext *ctx){
+    return ctx->nodes + (ctx->smp_nodes ? atomic_load_explicit(ctx->smp_nodes, memory_order_relaxed) : 0);
+}
+
 static bool search_should_abort(SearchContext *ctx){
     if (ctx->aborted) return true;
+    if (ctx->helper && (ctx->nodes & 1023)==0 && ctx->nodes!=ctx->smp_flushed) smp_flush_nodes(ctx);
     if (ctx->limits.node_limit && ctx->nodes >= ctx->limits.node_limit){ ctx->aborted = true; return true; }
     if (ctx->limits.stop && *ctx->limits.stop){ ctx->aborted = true; return true; }
-    if (ctx->limits.time_ms > 0){
-        double elapsed_ms = (double)(clock() - ctx->start) * 1000.0 / CLOCKS_PER_SEC;
+    if (ctx->limits.time_ms > 0 && (ctx->nodes & 1023)==0){
+        double elapsed_ms = (wall_seconds() - ctx->start) * 1000.0;
         if (elapsed_ms >= ctx->limits.time_ms){ ctx->aborted = true; return true; }
     }
     return false;
 }
 
-static int alphabeta(Position *pos,int depth,int alpha,int beta, SearchContext *ctx){
+static FFP_HOT int alphabeta(Position *pos,int depth,int alpha,int beta,int ply, SearchContext *ctx){
     if (search_should_abort(ctx)) return 0;
     ctx->nodes++;
+    ctx->pv_len[ply] = ply;
+    STAT_PLY(ctx, ply);
     if (depth==0) return evaluate(pos);
+
+    HashEntry *tte = NULL;
+    uint16_t tt_move = 0;
+    if (ctx->hash){
+        tte = &ctx->hash->entries[pos->key & ctx->hash->mask];
+        STAT_INC(ctx, tt_probes);
+        HashData hd;
+        if (hash_probe(tte, pos->key, &hd)){
+            STAT_INC(ctx, tt_hits);
+            tt_move = hd.move;
+            if (hd.depth>=depth){
+                int s = score_from_tt(hd.score, ply);
+                if (hd.bound==BOUND_EXACT){ STAT_INC(ctx, tt_cutoffs); return s>=beta ? beta : s<=alpha ? alpha : s; }
+                if (hd.bound==BOUND_LOWER && s>=beta){ STAT_INC(ctx, tt_cutoffs); return beta; }
+                if (hd.bound==BOUND_UPPER && s<=alpha){ STAT_INC(ctx, tt_cutoffs); return alpha; }
+            }
+        }
+    }
+
     MoveList ml; ffp_generate_legal(pos,&ml);
     if (ml.count==0){
         int ks = (pos->side==WHITE)? LSB_INDEX(pos->bb[WK]) : LSB_INDEX(pos->bb[BK]);
-        if (ffp_is_square_attacked(pos, ks, (Side)!pos->side)) return -20000 + (5-depth);
+        if (ffp_is_square_attacked(pos, ks, (Side)!pos->side)) return -MATE_SCORE + ply;
         return 0; // stalemate
     }
-    for (int i=0;i<ml.count;i++){
+    if (tt_move){
+        for (int i=1;i<ml.count;i++) if (ffp_move_pack(&ml.list[i])==tt_move){ Move t=ml.list[0]; ml.list[0]=ml.list[i]; ml.list[i]=t; break; }
+    }
+
+    int old_alpha = alpha;
+    uint16_t best = tt_move;
+    for (int i=0;i<ml.count;i++){
         Undo u; ffp_make_move(pos, ml.list[i], &u);
-        int score = -alphabeta(pos, depth-1, -beta, -alpha, ctx);
+        int score = -alphabeta(pos, depth-1, -beta, -alpha, ply+1, ctx);
         ffp_unmake_move(pos, ml.list[i], &u);
         if (ctx->aborted) return 0;
-        if (score>=beta) return beta;
-        if (score>alpha) alpha=score;
+        if (score>=beta){
+            STAT_INC(ctx, cutoffs);
+            if (i==0) STAT_INC(ctx, first_cutoffs);
+            if (tte) hash_store(tte, pos->key, depth, BOUND_LOWER, score_to_tt(beta, ply), ffp_move_pack(&ml.list[i]));
+            return beta;
+        }
+        if (score>alpha){
+            alpha=score;
+            best=ffp_move_pack(&ml.list[i]);
+            ctx->pv[ply][ply] = ml.list[i];
+            for (int j=ply+1;j<ctx->pv_len[ply+1];j++) ctx->pv[ply][j] = ctx->pv[ply+1][j];
+            ctx->pv_len[ply] = ctx->pv_len[ply+1];
+        }
     }
+    if (tte) hash_store(tte, pos->key, depth, alpha>old_alpha ? BOUND_EXACT : BOUND_UPPER, score_to_tt(alpha, ply), best);
     return alpha;
 }
 
-SearchResult ffp_search(Position *pos, const SearchLimits *limits){
+// Progress callbacks, rate-limited by min_interval_ms; *last holds the time of the previous call
+static bool callback_due(const SearchCallbacks *cb, double now, double *last){
+    if (cb->min_interval_ms>0 && *last>0 && (now-*last)*1000.0 < cb->min_interval_ms) return false;
+    *last = now;
+    return true;
+}
+
+// helper > 0: a Lazy SMP helper, which starts the root move list at a different
+// move so the threads fill the shared table with different subtrees first.
+// smp_nodes (NULL without helpers) carries the helpers' nodes to the main thread.
+static SearchResult search_run(Position *pos, const SearchLimits *limits, int helper, _Atomic uint64_t *smp_nodes){
     SearchLimits effective = {0};
     if (limits) effective = *limits;
     if (effective.max_depth <= 0) effective.max_depth = 4;
+    if (effective.max_depth >= FFP_MAX_PLY) effective.max_depth = FFP_MAX_PLY-1;
 
-    SearchContext ctx = {0};
-    ctx.nodes = 0;
-    ctx.start = clock();
-    ctx.limits = effective;
-    ctx.aborted = false;
+    SearchContext ctx_storage = {0}, *ctx = &ctx_storage;
+    ctx->nodes = 0;
+    ctx->start = wall_seconds();
+    ctx->limits = effective;
+    ctx->hash = (effective.hash && effective.hash->entries) ? effective.hash : NULL;
+    ctx->aborted = false;
+    ctx->helper = helper;
+    ctx->smp_nodes = smp_nodes;
 
     SearchResult result = {0};
     result.best_move.from = -1;
@@ -716,50 +1771,231 @@ SearchResult ffp_search(Position *pos, const SearchLimits *limits){
     if (rootMoves.count==0){
         int ks = (pos->side==WHITE)? LSB_INDEX(pos->bb[WK]) : LSB_INDEX(pos->bb[BK]);
         bool in_check = ffp_is_square_attacked(pos, ks, (Side)!pos->side);
-        result.score = in_check ? -20000 : 0;
+        result.score = in_check ? -MATE_SCORE : 0;
         result.aborted = false;
         return result;
     }
+    if (helper){
+        Move rot[256]; int k = helper % rootMoves.count;
+        for (int i=0;i<rootMoves.count;i++) rot[i] = rootMoves.list[(i+k) % rootMoves.count];
+        memcpy(rootMoves.list, rot, sizeof(Move)*rootMoves.count);
+    }
 
     Move best_so_far = rootMoves.list[0];
     int max_depth = effective.max_depth;
+    Move pv[FFP_MAX_PLY]; int pv_length=0;
+    const SearchCallbacks *cb = effective.callbacks;
+    double last_iteration = 0, last_best = 0;
+    uint16_t reported_best = 0;
     for (int depth=1; depth<=max_depth; ++depth){
         int best_score=-30000;
         Move best_move_depth = rootMoves.list[0];
         bool found=false;
+        uint64_t tr_iter = trace_now();
+#ifdef FFP_STATS
+        uint64_t nodes_before = ctx->nodes;
+        ctx->st = &ctx->stats.depth[depth];
+        ctx->stats.depths = depth;
+#endif
 
         for (int i=0;i<rootMoves.count;i++){
-            if (search_should_abort(&ctx)) break;
+            if (search_should_abort(ctx)) break;
+            uint64_t tr_move = trace_now();
             Undo u; ffp_make_move(pos, rootMoves.list[i], &u);
-            int score = -alphabeta(pos, depth-1, -30000, 30000, &ctx);
+            int score = -alphabeta(pos, depth-1, -30000, 30000, 1, ctx);
             ffp_unmake_move(pos, rootMoves.list[i], &u);
-            if (ctx.aborted) break;
+            if (trace_on){ char mv[6]; ffp_move_to_string(&rootMoves.list[i], mv); trace_event('X', "root move", tr_move, "depth", depth, mv); }
+            if (ctx->aborted) break;
             if (!found || score>best_score){
                 best_score=score;
                 best_move_depth=rootMoves.list[i];
                 found=true;
+                pv[0] = rootMoves.list[i];
+                pv_length = ctx->pv_len[1] > 1 ? ctx->pv_len[1] : 1;
+                for (int j=1;j<pv_length;j++) pv[j] = ctx->pv[1][j];
+                uint16_t packed = ffp_move_pack(&pv[0]);
+                if (cb && cb->best_move && packed!=reported_best && callback_due(cb, wall_seconds(), &last_best)){
+                    reported_best = packed;
+                    SearchResult cur = result;
+                    cur.best_move = pv[0]; cur.depth_reached = depth; cur.score = best_score;
+                    cur.nodes = search_nodes(ctx); cur.seconds = wall_seconds()-ctx->start;
+                    memcpy(cur.pv, pv, sizeof(Move)*pv_length);
+                    cur.pv_length = pv_length;
+                    cb->best_move(&cur, cb->user);
+                }
             }
         }
 
-        result.nodes = ctx.nodes;
-        result.aborted = ctx.aborted;
-        if (ctx.aborted) break;
+#ifdef FFP_STATS
+        ctx->st->nodes = ctx->nodes - nodes_before;
+#endif
+        TRACE_SPAN("iteration", tr_iter, "depth", depth);
+        result.nodes = search_nodes(ctx);
+        result.aborted = ctx->aborted;
+        if (ctx->aborted) break;
         if (found){
             best_so_far = best_move_depth;
             result.best_move = best_so_far;
             result.depth_reached = depth;
             result.score = best_score;
+            memcpy(result.pv, pv, sizeof(Move)*pv_length);
+            result.pv_length = pv_length;
+            result.seconds = wall_seconds()-ctx->start;
+            if (cb && cb->iteration && callback_due(cb, wall_seconds(), &last_iteration)) cb->iteration(&result, cb->user);
         }
     }
 
     if (result.best_move.from==-1){
         result.best_move = best_so_far;
+        result.pv[0] = best_so_far;
+        result.pv_length = 1;
     }
-    result.nodes = ctx.nodes;
-    result.aborted = ctx.aborted;
+    if (helper) smp_flush_nodes(ctx);
+    result.nodes = ctx->nodes;
+    result.aborted = ctx->aborted;
+    result.seconds = wall_seconds()-ctx->start;
+#ifdef FFP_STATS
+    if (effective.stats) ffp_search_stats_merge(effective.stats, &ctx->stats);
+#endif
     return result;
 }
 
+// Lazy SMP: every worker searches the whole tree and they share only the table;
+// worker 0 gives the result and stops the helpers when it finishes
+typedef struct {
+    Position pos;
+    SearchLimits limits;
+    SearchResult result;
+    volatile bool stop;
+    _Atomic uint64_t helper_nodes;
+} SmpJob;
+
+static void smp_worker(int worker, void *arg){
+    SmpJob *job=(SmpJob*)arg;
+    Position pos = job->pos;
+    SearchLimits limits = job->limits;
+    if (worker==0){
+        job->result = search_run(&pos, &limits, 0, &job->helper_nodes);
+        job->stop = true;
+        return;
+    }
+    limits.stop = &job->stop;   // the main thread also relays an external stop
+    limits.stats = NULL;
+    limits.callbacks = NULL;
+    search_run(&pos, &limits, worker, &job->helper_nodes);
+}
+
+static SearchResult search_on_pool(WorkerPool *wp, Position *pos, const SearchLimits *limits){
+    SearchResult res;
+    SmpJob *job = NULL;
+    if (!limits || limits->threads<=1 || !limits->hash || !limits->hash->entries || !(job = calloc(1, sizeof(SmpJob))))
+        res = search_run(pos, limits, 0, NULL);
+    else {
+        job->pos = *pos; job->limits = *limits;
+        pool_run(wp, limits->threads, smp_worker, job);
+        res = job->result;
+        res.nodes += atomic_load(&job->helper_nodes);
+        free(job);
+    }
+    const SearchCallbacks *cb = limits ? limits->callbacks : NULL;
+    if (cb && cb->finish) cb->finish(&res, cb->user);
+    return res;
+}
+
+SearchResult ffp_search(Position *pos, const SearchLimits *limits){
+    return search_on_pool(&shared_pool, pos, limits);
+}
+
+uint64_t ffp_perft(Position *pos, int depth){ return depth>0 ? perft(pos, depth) : 1; }
+
+// Engine handles: everything a search needs besides the position, owned per
+// instance so independent engines can run concurrently in one process
+struct FfpEngine {
+    WorkerPool pool;
+    HashTable hash;
+    int threads, affinity;
+    char shared[SHARED_HASH_NAME];  // SharedHash name, "" = private table
+    volatile bool stop;
+};
+
+// Replaces the table: mb megabytes private, or the named shared one
+static bool engine_hash(FfpEngine *e, size_t mb, const char *shared){
+    HashTable tt;
+    bool named = shared && *shared && strcmp(shared, "<empty>");
+    if (!(named ? ffp_hash_attach(&tt, shared, mb) : ffp_hash_init(&tt, mb))) return false;
+    ffp_hash_free(&e->hash);
+    e->hash = tt;
+    if (!named) hash_clear_on(&e->pool, &e->hash, e->threads);
+    snprintf(e->shared, sizeof(e->shared), "%s", named ? shared : "");
+    return true;
+}
+
+FfpEngine *ffp_engine_create(const EngineOptions *options){
+    EngineOptions o = {0};
+    if (options) o = *options;
+    FfpEngine *e = calloc(1, sizeof(FfpEngine));
+    if (!e) return NULL;
+    e->pool = (WorkerPool)WORKER_POOL_INIT;
+    e->threads = o.threads>0 ? o.threads : 1;
+    e->affinity = o.affinity;
+    pool_reserve(&e->pool, e->threads, e->affinity);
+    if (!engine_hash(e, (size_t)(o.hash_mb>0 ? o.hash_mb : 16), o.shared_hash)){ ffp_engine_destroy(e); return NULL; }
+    return e;
+}
+
+void ffp_engine_destroy(FfpEngine *e){
+    if (!e) return;
+    pool_shutdown(&e->pool);
+    ffp_hash_free(&e->hash);
+    pthread_mutex_destroy(&e->pool.owner); pthread_mutex_destroy(&e->pool.lock);
+    pthread_cond_destroy(&e->pool.wake); pthread_cond_destroy(&e->pool.done);
+    free(e);
+}
+
+bool ffp_engine_set_option(FfpEngine *e, const char *name, const char *value){
+    if (!e || !name) return false;
+    if (!strcmp(name,"Hash") && value && atoi(value)>0) return engine_hash(e, (size_t)atoi(value), e->shared);
+    if (!strcmp(name,"SharedHash")) return engine_hash(e, e->hash.bytes>>20, value);
+    if (!strcmp(name,"Threads") && value && atoi(value)>0){
+        e->threads = atoi(value);
+        pool_reserve(&e->pool, e->threads, e->affinity);
+        return true;
+    }
+    if (!strcmp(name,"Affinity") && value){
+        e->affinity = !strcmp(value,"cpu") ? AFFINITY_CPU : !strcmp(value,"node") ? AFFINITY_NODE : AFFINITY_NONE;
+        pool_reserve(&e->pool, e->threads, e->affinity);
+        return true;
+    }
+    if (!strcmp(name,"Clear Hash")){ hash_clear_on(&e->pool, &e->hash, e->threads); return true; }
+    return false;
+}
+
+// A shared table is left alone: other processes are still using it
+void ffp_engine_new_game(FfpEngine *e){
+    if (e && !e->hash.segment) hash_clear_on(&e->pool, &e->hash, e->threads);
+}
+
+const HashTable *ffp_engine_hash(const FfpEngine *e){ return e ? &e->hash : NULL; }
+
+void ffp_engine_stop(FfpEngine *e){
+    if (e) e->stop = true;
+}
+
+SearchResult ffp_engine_search(FfpEngine *e, Position *pos, const SearchLimits *limits, const SearchCallbacks *cb){
+    if (!e){
+        SearchResult none = { .best_move = { .from=-1, .to=-1, .piece=-1 }, .aborted = true };
+        return none;
+    }
+    SearchLimits l = {0};
+    if (limits) l = *limits;
+    l.hash = &e->hash;
+    l.threads = e->threads;
+    e->stop = false;
+    if (!l.stop) l.stop = &e->stop;
+    if (cb) l.callbacks = cb;
+    return search_on_pool(&e->pool, pos, &l);
+}
+
 void ffp_move_to_string(const Move *move, char out[6]){
     if (!out) return;
     if (!move || move->from < 0 || move->to < 0){
@@ -767,9 +2003,9 @@ void ffp_move_to_string(const Move *move, char out[6]){
         return;
     }
     out[0]='a'+(move->from%8);
-    out[1]='1'+(move->from/8);
+    out[1]='8'-(move->from/8);
     out[2]='a'+(move->to%8);
-    out[3]='1'+(move->to/8);
+    out[3]='8'-(move->to/8);
     if (move->flags & MF_PROMO){
         int t = type_of_piece(move->promo);
         out[4] = (t==4)?'q':(t==1)?'r':(t==3)?'b':'n';
@@ -786,8 +2022,8 @@ bool ffp_move_from_string(const Position *pos, const char *uci, Move *out_move){
     int tfile = uci[2]-'a';
     int trank = uci[3]-'1';
     if (ffile<0||ffile>7||tfile<0||tfile>7||frank<0||frank>7||trank<0||trank>7) return false;
-    int from = frank*8 + ffile;
-    int to = trank*8 + tfile;
+    int from = (7-frank)*8 + ffile;
+    int to = (7-trank)*8 + tfile;
     int promo = -1;
     if (uci[4]){
         char pc = tolower((unsigned char)uci[4]);
@@ -809,6 +2045,620 @@ bool ffp_move_from_string(const Position *pos, const char *uci, Move *out_move){
     return false;
 }
 
+// Game results
+static const char *RESULT_STR[4] = {"*", "0-1", "1/2-1/2", "1-0"};
+
+static int parse_result(const char *s, int len){
+    for (int r=FFP_RESULT_BLACK_WIN; r<=FFP_RESULT_WHITE_WIN; r++)
+        if ((size_t)len==strlen(RESULT_STR[r]) && !memcmp(s, RESULT_STR[r], len)) return r;
+    return FFP_RESULT_NONE;
+}
+
+// SAN
+static bool move_is_legal(const Position *pos, Move m){
+    Position p=*pos; Undo u; ffp_make_move(&p, m, &u);
+    int ks = LSB_INDEX(p.bb[pos->side==WHITE ? WK : BK]);
+    return !ffp_is_square_attacked(&p, ks, (Side)!pos->side);
+}
+
+static bool castle_move(const Position *pos, bool queen_side, Move *out){
+    bool w = pos->side==WHITE;
+    int right = w ? (queen_side?2:1) : (queen_side?8:4);
+    int k = w ? 60 : 4, to = queen_side ? k-2 : k+2;
+    U64 path = queen_side ? (7ULL<<(k-3)) : (3ULL<<(k+1));
+    if (!(pos->castling & right) || (pos->occ_all & path) || !get_bit(pos->bb[w?WK:BK], k)) return false;
+    Side them = w ? BLACK : WHITE;
+    if (ffp_is_square_attacked(pos,k,them) || ffp_is_square_attacked(pos,(k+to)/2,them) || ffp_is_square_attacked(pos,to,them)) return false;
+    *out = (Move){k, to, w?WK:BK, -1, -1, MF_CASTLE};
+    return true;
+}
+
+static int promo_type(char c){
+    switch (toupper((unsigned char)c)){ case 'Q': return 4; case 'R': return 1; case 'B': return 3; case 'N': return 2; }
+    return 0;
+}
+
+// Resolves SAN from the attack set of the moving piece type seen from the target
+// square; only the (usually single) candidate is made on a copy to test legality.
+static bool san_to_move(const Position *pos, const char *s, int len, Move *out){
+    while (len>0 && strchr("+#!?", s[len-1])) len--;
+    if (len<2) return false;
+    if (s[0]=='O' || s[0]=='0'){
+        if (len==3 && (!memcmp(s,"O-O",3) || !memcmp(s,"0-0",3))) return castle_move(pos, false, out);
+        if (len==5 && (!memcmp(s,"O-O-O",5) || !memcmp(s,"0-0-0",5))) return castle_move(pos, true, out);
+        return false;
+    }
+    const char *p=s, *e=s+len;
+    int pt=0;
+    switch (*p){ case 'N': pt=2; break; case 'B': pt=3; break; case 'R': pt=1; break; case 'Q': pt=4; break; case 'K': pt=5; break; }
+    if (pt) p++;
+    int promo=0;
+    if (!pt && e-p>=3 && e[-2]=='='){ promo=promo_type(e[-1]); if (!promo) return false; e-=2; }
+    else if (!pt && e-p>=3 && strchr("QRBN", e[-1])){ promo=promo_type(e[-1]); e--; }
+    if (e-p<2) return false;
+    int tf=e[-2]-'a', tr=e[-1]-'1';
+    if (tf<0||tf>7||tr<0||tr>7) return false;
+    int to=(7-tr)*8+tf;
+    e-=2;
+    int df=-1, dr=-1;
+    for (; p<e; p++){
+        if (*p>='a' && *p<='h') df=*p-'a';
+        else if (*p>='1' && *p<='8') dr=*p-'1';
+        else if (*p!='x' && *p!='-') return false;
+    }
+
+    const Side us=pos->side;
+    const int piece=(us==WHITE ? WP : BP)+pt;
+    const U64 target=1ULL<<to, occ=pos->occ_all;
+    if (target & (us==WHITE ? pos->occ_white : pos->occ_black)) return false;
+    if ((pt==0 && (to<8 || to>=56)) != (promo!=0)) return false;
+    U64 cand=0;
+    switch (pt){
+        case 0:
+            if (df>=0 && df!=tf){
+                cand = (us==WHITE ? black_pawn_attacks(target) : white_pawn_attacks(target)) & pos->bb[piece];
+            } else if (!(occ & target)){
+                int dir = us==WHITE ? 8 : -8, from = to+dir;
+                if (from>=0 && from<64 && get_bit(pos->bb[piece], from)) cand = 1ULL<<from;
+                else if (from>=0 && from<64 && !get_bit(occ, from) && to/8==(us==WHITE ? 4 : 3)
+                         && get_bit(pos->bb[piece], from+dir)) cand = 1ULL<<(from+dir);
+            }
+            break;
+        case 1: cand = rook_attacks_from(target, occ)   & pos->bb[piece]; break;
+        case 2: cand = knight_attacks_from(target)      & pos->bb[piece]; break;
+        case 3: cand = bishop_attacks_from(target, occ) & pos->bb[piece]; break;
+        case 4: cand = queen_attacks_from(target, occ)  & pos->bb[piece]; break;
+        case 5: cand = king_attacks_from(target)        & pos->bb[piece]; break;
+    }
+    if (df>=0) cand &= FILE_A<<df;
+    if (dr>=0) cand &= RANK_MASK(dr+1);
+
+    int found=0;
+    for (; cand; cand&=cand-1){
+        Move m;
+        if (!ffp_move_unpack(pos, (uint16_t)(LSB_INDEX(cand) | to<<6 | promo<<12), &m)) continue;
+        if (m.flags & MF_CASTLE) continue; // king steps only; castling is O-O
+        if (!move_is_legal(pos, m)) continue;
+        if (found++) return false; // ambiguous
+        *out=m;
+    }
+    return found==1;
+}
+
+// Check from the changed occupancy: direct attack by the moved piece or a slider uncovered behind it
+static bool gives_check(const Position *pos, Move m){
+    const bool w = pos->side==WHITE;
+    const U64 king = pos->bb[w ? BK : WK];
+    const U64 from = 1ULL<<m.from, to = 1ULL<<m.to;
+    U64 occ = (pos->occ_all & ~from) | to;
+    U64 rq = (pos->bb[w?WR:BR] | pos->bb[w?WQ:BQ]) & ~from;
+    U64 bq = (pos->bb[w?WB:BB] | pos->bb[w?WQ:BQ]) & ~from;
+    if (m.flags & MF_ENPASSANT) occ &= ~(1ULL<<(w ? m.to+8 : m.to-8));
+    if (m.flags & MF_CASTLE){
+        U64 rfrom = 1ULL<<(m.to>m.from ? m.from+3 : m.from-4), rto = 1ULL<<((m.from+m.to)/2);
+        occ = (occ & ~rfrom) | rto;
+        rq  = (rq  & ~rfrom) | rto;
+    }
+    switch (type_of_piece((m.flags & MF_PROMO) ? m.promo : m.piece)){
+        case 0: if ((w ? white_pawn_attacks(to) : black_pawn_attacks(to)) & king) return true; break;
+        case 2: if (knight_attacks_from(to) & king) return true; break;
+        case 1: rq |= to; break;
+        case 3: bq |= to; break;
+        case 4: rq |= to; bq |= to; break;
+    }
+    return (rook_attacks_from(king, occ) & rq) || (bishop_attacks_from(king, occ) & bq);
+}
+
+// Stops at the first legal move; king moves are generated last, so they are tried first
+static bool has_legal_move(const Position *pos){
+    MoveList ml; ffp_generate_pseudo_legal(pos, &ml);
+    for (int i=ml.count-1; i>=0; i--) if (move_is_legal(pos, ml.list[i])) return true;
+    return false;
+}
+
+bool ffp_move_to_san(const Position *pos, const Move *move, char out[8]){
+    if (!out) return false;
+    out[0]='\0';
+    if (!pos || !move || move->from<0 || move->to<0 || move->piece<0) return false;
+    const Move m = *move;
+    int n=0;
+    if (m.flags & MF_CASTLE){
+        memcpy(out, m.to>m.from ? "O-O" : "O-O-O", m.to>m.from ? 3 : 5);
+        n = m.to>m.from ? 3 : 5;
+    } else {
+        const int t = type_of_piece(m.piece);
+        const U64 target = 1ULL<<m.to;
+        if (t==0){
+            if (m.flags & MF_CAPTURE) out[n++] = 'a'+m.from%8;
+        } else {
+            out[n++] = "PRNBQK"[t];
+            U64 others = 0;
+            switch (t){
+                case 1: others = rook_attacks_from(target, pos->occ_all);   break;
+                case 2: others = knight_attacks_from(target);               break;
+                case 3: others = bishop_attacks_from(target, pos->occ_all); break;
+                case 4: others = queen_attacks_from(target, pos->occ_all);  break;
+            }
+            others &= pos->bb[m.piece] & ~(1ULL<<m.from);
+            bool same_file=false, same_rank=false, any=false;
+            for (; others; others&=others-1){
+                int sq = LSB_INDEX(others);
+                Move alt = m; alt.from = sq;
+                if (!move_is_legal(pos, alt)) continue;
+                any = true;
+                if (sq%8==m.from%8) same_file=true;
+                if (sq/8==m.from/8) same_rank=true;
+            }
+            if (any && (!same_file || same_rank)) out[n++] = 'a'+m.from%8;
+            if (any && same_file) out[n++] = '8'-m.from/8;
+        }
+        if (m.flags & MF_CAPTURE) out[n++] = 'x';
+        out[n++] = 'a'+m.to%8;
+        out[n++] = '8'-m.to/8;
+        if (m.flags & MF_PROMO){ out[n++] = '='; out[n++] = "PRNBQK"[type_of_piece(m.promo)]; }
+    }
+    if (gives_check(pos, m)){
+        Position p=*pos; Undo u; ffp_make_move(&p, m, &u);
+        out[n++] = has_legal_move(&p) ? '+' : '#';
+    }
+    out[n]='\0';
+    return true;
+}
+
+bool ffp_move_from_san(const Position *pos, const char *san, Move *out_move){
+    if (!pos || !san) return false;
+    Move m;
+    if (!san_to_move(pos, san, (int)strlen(san), &m)) return false;
+    if (out_move) *out_move = m;
+    return true;
+}
+
+// PGN
+static inline bool is_space(char c){ return c==' ' || c=='\t' || c=='\n' || c=='\r'; }
+
+const PgnTag *ffp_pgn_find_tag(const PgnGame *game, const char *name){
+    size_t n=strlen(name);
+    for (int i=0;i<game->tag_count;i++)
+        if ((size_t)game->tags[i].name_len==n && !memcmp(game->tags[i].name, name, n)) return &game->tags[i];
+    return NULL;
+}
+
+static bool at_line_start(const char *data, const char *p){ return p==data || p[-1]=='\n'; }
+
+// Parses one game starting at *cursor; returns false at the end of the range
+static bool pgn_game(const char *data, size_t end, size_t *cursor, PgnGame *g, const PgnCallbacks *cb, PgnStats *st){
+    const char *p=data+*cursor, *e=data+end;
+    while (p<e && (is_space(*p) || (unsigned char)*p==0xEF || (unsigned char)*p==0xBB || (unsigned char)*p==0xBF)) p++;
+    if (p>=e){ *cursor=end; return false; }
+    g->offset=(size_t)(p-data); g->tag_count=0; g->result=FFP_RESULT_NONE; g->plies=0;
+
+    // Tag pairs
+    while (p<e && *p=='['){
+        const char *q=++p;
+        while (p<e && !is_space(*p) && *p!='"' && *p!=']') p++;
+        PgnTag t = {q, NULL, (int)(p-q), 0};
+        while (p<e && *p!='"' && *p!=']' && *p!='\n') p++;
+        if (p<e && *p=='"'){
+            q=++p;
+            while (p<e && *p!='"'){ if (*p=='\\' && p+1<e) p++; p++; }
+            t.value=q; t.value_len=(int)(p-q);
+        }
+        while (p<e && *p!=']' && *p!='\n') p++;
+        if (p<e && *p==']') p++;
+        if (g->tag_count<FFP_PGN_MAX_TAGS) g->tags[g->tag_count++]=t;
+        while (p<e && is_space(*p)) p++;
+    }
+    const PgnTag *t = ffp_pgn_find_tag(g, "Result");
+    if (t) g->result = parse_result(t->value, t->value_len);
+    t = ffp_pgn_find_tag(g, "FEN");
+    bool ok = t ? parse_fen(&g->start, t->value, t->value+t->value_len, NULL) : ffp_position_from_fen(&g->start, FFP_FEN_STARTPOS);
+    Position pos = g->start;
+    bool active = ok;
+
+    // Movetext
+    while (p<e){
+        char c=*p;
+        if (is_space(c)){ p++; continue; }
+        if (c=='[' && at_line_start(data, p)) break; // next game without a result token
+        if (c=='{'){ while (p<e && *p!='}') p++; if (p<e) p++; continue; }
+        if (c==';'){ while (p<e && *p!='\n') p++; continue; }
+        if (c=='('){
+            int depth=0;
+            for (; p<e; p++){
+                if (*p=='{'){ while (p<e && *p!='}') p++; if (p>=e) break; }
+                else if (*p=='(') depth++;
+                else if (*p==')' && --depth==0){ p++; break; }
+            }
+            continue;
+        }
+        const char *q=p;
+        while (p<e && !is_space(*p) && !strchr("{}();[", *p)) p++;
+        int len=(int)(p-q);
+        if (!len){ p++; continue; } // stray bracket
+        if (c=='$' || c=='.') continue;
+        int r = parse_result(q, len);
+        if (r || (len==1 && c=='*')){ if (r) g->result=r; break; }
+        if (isdigit((unsigned char)c)){
+            const char *d=q; while (d<p && isdigit((unsigned char)*d)) d++;
+            if (d<p && *d=='.'){ while (d<p && *d=='.') d++; q=d; len=(int)(p-q); if (!len) continue; }
+        }
+        if (!active) continue;
+        Move m;
+        if (!san_to_move(&pos, q, len, &m)){ ok=active=false; continue; }
+        st->moves++;
+        if (cb && cb->on_move && !cb->on_move(g, &pos, &m, cb->user)) active=false;
+        Undo u; ffp_make_move(&pos, m, &u);
+        g->plies++;
+    }
+    while (p<e && *p!='\n' && *p!='[') p++;
+    *cursor=(size_t)(p-data);
+    st->games++;
+    if (!ok) st->errors++;
+    if (cb && cb->on_game) cb->on_game(g, &pos, ok, cb->user);
+    return true;
+}
+
+typedef struct {
+    const char *data;
+    const size_t *bounds;
+    const PgnCallbacks *cb;
+    PgnStats *stats;
+} PgnJob;
+
+static void pgn_worker(int worker, void *arg){
+    PgnJob *job=(PgnJob*)arg;
+    PgnGame game; game.worker=worker;
+    size_t cursor=job->bounds[worker];
+    while (pgn_game(job->data, job->bounds[worker+1], &cursor, &game, job->cb, &job->stats[worker])) {}
+}
+
+bool ffp_pgn_read(const char *data, size_t size, int threads, const PgnCallbacks *cb, PgnStats *stats){
+    int parts = threads<1 ? 1 : threads;
+    if ((size_t)parts > size/65536+1) parts = (int)(size/65536+1);
+    size_t *bounds = malloc(sizeof(size_t)*(parts+1));
+    PgnStats *st = calloc(parts, sizeof(PgnStats));
+    if (!bounds || !st){ free(bounds); free(st); return false; }
+    // Split at "[Event " tags that start a line
+    bounds[0]=0;
+    for (int i=1;i<parts;i++){
+        size_t b = size/parts*i;
+        if (b<bounds[i-1]) b=bounds[i-1];
+        const char *hit=NULL;
+        for (const char *q=data+b; q<data+size && (q=memchr(q, '[', (size_t)(data+size-q))); q++){
+            if (at_line_start(data, q) && (size_t)(data+size-q)>=7 && !memcmp(q, "[Event ", 7)){ hit=q; break; }
+        }
+        bounds[i] = hit ? (size_t)(hit-data) : size;
+    }
+    bounds[parts]=size;
+
+    PgnJob job = { data, bounds, cb, st };
+    double t0 = wall_seconds();
+    run_workers(parts, pgn_worker, &job);
+    if (stats){
+        memset(stats, 0, sizeof(*stats));
+        for (int i=0;i<parts;i++){ stats->games+=st[i].games; stats->moves+=st[i].moves; stats->errors+=st[i].errors; }
+        stats->bytes = size;
+        stats->seconds = wall_seconds()-t0;
+    }
+    free(bounds); free(st);
+    return true;
+}
+
+bool ffp_pgn_read_file(const char *path, int threads, const PgnCallbacks *cb, PgnStats *stats){
+    MappedFile file;
+    if (!ffp_file_map(&file, path)) return false;
+    bool ok = ffp_pgn_read(file.data, file.size, threads, cb, stats);
+    ffp_file_unmap(&file);
+    return ok;
+}
+
+// Polyglot opening books: 16-byte big-endian entries (key, move, weight, learn)
+// sorted by key. Keys use the published Polyglot Random64 table: 768 piece
+// entries (64*kind + 8*row + file, kind = 2*type + white, row 0 = rank 1),
+// 4 castling rights, 8 en-passant files and the side to move.
+static const U64 POLYGLOT_RANDOM[781] = {
+    0x9D39247E33776D41, 0x2AF7398005AAA5C7, 0x44DB015024623547, 0x9C15F73E62A76AE2,
+    0x75834465489C0C89, 0x3290AC3A203001BF, 0x0FBBAD1F61042279, 0xE83A908FF2FB60CA,
+    0x0D7E765D58755C10, 0x1A083822CEAFE02D, 0x9605D5F0E25EC3B0, 0xD021FF5CD13A2ED5,
+    0x40BDF15D4A672E32, 0x011355146FD56395, 0x5DB4832046F3D9E5, 0x239F8B2D7FF719CC,
+    0x05D1A1AE85B49AA1, 0x679F848F6E8FC971, 0x7449BBFF801FED0B, 0x7D11CDB1C3B7ADF0,
+    0x82C7709E781EB7CC, 0xF3218F1C9510786C, 0x331478F3AF51BBE6, 0x4BB38DE5E7219443,
+    0xAA649C6EBCFD50FC, 0x8DBD98A352AFD40B, 0x87D2074B81D79217, 0x19F3C751D3E92AE1,
+    0xB4AB30F062B19ABF, 0x7B0500AC42047AC4, 0xC9452CA81A09D85D, 0x24AA6C514DA27500,
+    0x4C9F34427501B447, 0x14A68FD73C910841, 0xA71B9B83461CBD93, 0x03488B95B0F1850F,
+    0x637B2B34FF93C040, 0x09D1BC9A3DD90A94, 0x3575668334A1DD3B, 0x735E2B97A4C45A23,
+    0x18727070F1BD400B, 0x1FCBACD259BF02E7, 0xD310A7C2CE9B6555, 0xBF983FE0FE5D8244,
+    0x9F74D14F7454A824, 0x51EBDC4AB9BA3035, 0x5C82C505DB9AB0FA, 0xFCF7FE8A3430B241,
+    0x3253A729B9BA3DDE, 0x8C74C368081B3075, 0xB9BC6C87167C33E7, 0x7EF48F2B83024E20,
+    0x11D505D4C351BD7F, 0x6568FCA92C76A243, 0x4DE0B0F40F32A7B8, 0x96D693460CC37E5D,
+    0x42E240CB63689F2F, 0x6D2BDCDAE2919661, 0x42880B0236E4D951, 0x5F0F4A5898171BB6,
+    0x39F890F579F92F88, 0x93C5B5F47356388B, 0x63DC359D8D231B78, 0xEC16CA8AEA98AD76,
+    0x5355F900C2A82DC7, 0x07FB9F855A997142, 0x5093417AA8A7ED5E, 0x7BCBC38DA25A7F3C,
+    0x19FC8A768CF4B6D4, 0x637A7780DECFC0D9, 0x8249A47AEE0E41F7, 0x79AD695501E7D1E8,
+    0x14ACBAF4777D5776, 0xF145B6BECCDEA195, 0xDABF2AC8201752FC, 0x24C3C94DF9C8D3F6,
+    0xBB6E2924F03912EA, 0x0CE26C0B95C980D9, 0xA49CD132BFBF7CC4, 0xE99D662AF4243939,
+    0x27E6AD7891165C3F, 0x8535F040B9744FF1, 0x54B3F4FA5F40D873, 0x72B12C32127FED2B,
+    0xEE954D3C7B411F47, 0x9A85AC909A24EAA1, 0x70AC4CD9F04F21F5, 0xF9B89D3E99A075C2,
+    0x87B3E2B2B5C907B1, 0xA366E5B8C54F48B8, 0xAE4A9346CC3F7CF2, 0x1920C04D47267BBD,
+    0x87BF02C6B49E2AE9, 0x092237AC237F3859, 0xFF07F64EF8ED14D0, 0x8DE8DCA9F03CC54E,
+    0x9C1633264DB49C89, 0xB3F22C3D0B0B38ED, 0x390E5FB44D01144B, 0x5BFEA5B4712768E9,
+    0x1E1032911FA78984, 0x9A74ACB964E78CB3, 0x4F80F7A035DAFB04, 0x6304D09A0B3738C4,
+    0x2171E64683023A08, 0x5B9B63EB9CEFF80C, 0x506AACF489889342, 0x1881AFC9A3A701D6,
+    0x6503080440750644, 0xDFD395339CDBF4A7, 0xEF927DBCF00C20F2, 0x7B32F7D1E03680EC,
+    0xB9FD7620E7316243, 0x05A7E8A57DB91B77, 0xB5889C6E15630A75, 0x4A750A09CE9573F7,
+    0xCF464CEC899A2F8A, 0xF538639CE705B824, 0x3C79A0FF5580EF7F, 0xEDE6C87F8477609D,
+    0x799E81F05BC93F31, 0x86536B8CF3428A8C, 0x97D7374C60087B73, 0xA246637CFF328532,
+    0x043FCAE60CC0EBA0, 0x920E449535DD359E, 0x70EB093B15B290CC, 0x73A1921916591CBD,
+    0x56436C9FE1A1AA8D, 0xEFAC4B70633B8F81, 0xBB215798D45DF7AF, 0x45F20042F24F1768,
+    0x930F80F4E8EB7462, 0xFF6712FFCFD75EA1, 0xAE623FD67468AA70, 0xDD2C5BC84BC8D8FC,
+    0x7EED120D54CF2DD9, 0x22FE545401165F1C, 0xC91800E98FB99929, 0x808BD68E6AC10365,
+    0xDEC468145B7605F6, 0x1BEDE3A3AEF53302, 0x43539603D6C55602, 0xAA969B5C691CCB7A,
+    0xA87832D392EFEE56, 0x65942C7B3C7E11AE, 0xDED2D633CAD004F6, 0x21F08570F420E565,
+    0xB415938D7DA94E3C, 0x91B859E59ECB6350, 0x10CFF333E0ED804A, 0x28AED140BE0BB7DD,
+    0xC5CC1D89724FA456, 0x5648F680F11A2741, 0x2D255069F0B7DAB3, 0x9BC5A38EF729ABD4,
+    0xEF2F054308F6A2BC, 0xAF2042F5CC5C2858, 0x480412BAB7F5BE2A, 0xAEF3AF4A563DFE43,
+    0x19AFE59AE451497F, 0x52593803DFF1E840, 0xF4F076E65F2CE6F0, 0x11379625747D5AF3,
+    0xBCE5D2248682C115, 0x9DA4243DE836994F, 0x066F70B33FE09017, 0x4DC4DE189B671A1C,
+    0x51039AB7712457C3, 0xC07A3F80C31FB4B4, 0xB46EE9C5E64A6E7C, 0xB3819A42ABE61C87,
+    0x21A007933A522A20, 0x2DF16F761598AA4F, 0x763C4A1371B368FD, 0xF793C46702E086A0,
+    0xD7288E012AEB8D31, 0xDE336A2A4BC1C44B, 0x0BF692B38D079F23, 0x2C604A7A177326B3,
+    0x4850E73E03EB6064, 0xCFC447F1E53C8E1B, 0xB05CA3F564268D99, 0x9AE182C8BC9474E8,
+    0xA4FC4BD4FC5558CA, 0xE755178D58FC4E76, 0x69B97DB1A4C03DFE, 0xF9B5B7C4ACC67C96,
+    0xFC6A82D64B8655FB, 0x9C684CB6C4D24417, 0x8EC97D2917456ED0, 0x6703DF9D2924E97E,
+    0xC547F57E42A7444E, 0x78E37644E7CAD29E, 0xFE9A44E9362F05FA, 0x08BD35CC38336615,
+    0x9315E5EB3A129ACE, 0x94061B871E04DF75, 0xDF1D9F9D784BA010, 0x3BBA57B68871B59D,
+    0xD2B7ADEEDED1F73F, 0xF7A255D83BC373F8, 0xD7F4F2448C0CEB81, 0xD95BE88CD210FFA7,
+    0x336F52F8FF4728E7, 0xA74049DAC312AC71, 0xA2F61BB6E437FDB5, 0x4F2A5CB07F6A35B3,
+    0x87D380BDA5BF7859, 0x16B9F7E06C453A21, 0x7BA2484C8A0FD54E, 0xF3A678CAD9A2E38C,
+    0x39B0BF7DDE437BA2, 0xFCAF55C1BF8A4424, 0x18FCF680573FA594, 0x4C0563B89F495AC3,
+    0x40E087931A00930D, 0x8CFFA9412EB642C1, 0x68CA39053261169F, 0x7A1EE967D27579E2,
+    0x9D1D60E5076F5B6F, 0x3810E399B6F65BA2, 0x32095B6D4AB5F9B1, 0x35CAB62109DD038A,
+    0xA90B24499FCFAFB1, 0x77A225A07CC2C6BD, 0x513E5E634C70E331, 0x4361C0CA3F692F12,
+    0xD941ACA44B20A45B, 0x528F7C8602C5807B, 0x52AB92BEB9613989, 0x9D1DFA2EFC557F73,
+    0x722FF175F572C348, 0x1D1260A51107FE97, 0x7A249A57EC0C9BA2, 0x04208FE9E8F7F2D6,
+    0x5A110C6058B920A0, 0x0CD9A497658A5698, 0x56FD23C8F9715A4C, 0x284C847B9D887AAE,
+    0x04FEABFBBDB619CB, 0x742E1E651C60BA83, 0x9A9632E65904AD3C, 0x881B82A13B51B9E2,
+    0x506E6744CD974924, 0xB0183DB56FFC6A79, 0x0ED9B915C66ED37E, 0x5E11E86D5873D484,
+    0xF678647E3519AC6E, 0x1B85D488D0F20CC5, 0xDAB9FE6525D89021, 0x0D151D86ADB73615,
+    0xA865A54EDCC0F019, 0x93C42566AEF98FFB, 0x99E7AFEABE000731, 0x48CBFF086DDF285A,
+    0x7F9B6AF1EBF78BAF, 0x58627E1A149BBA21, 0x2CD16E2ABD791E33, 0xD363EFF5F0977996,
+    0x0CE2A38C344A6EED, 0x1A804AADB9CFA741, 0x907F30421D78C5DE, 0x501F65EDB3034D07,
+    0x37624AE5A48FA6E9, 0x957BAF61700CFF4E, 0x3A6C27934E31188A, 0xD49503536ABCA345,
+    0x088E049589C432E0, 0xF943AEE7FEBF21B8, 0x6C3B8E3E336139D3, 0x364F6FFA464EE52E,
+    0xD60F6DCEDC314222, 0x56963B0DCA418FC0, 0x16F50EDF91E513AF, 0xEF1955914B609F93,
+    0x565601C0364E3228, 0xECB53939887E8175, 0xBAC7A9A18531294B, 0xB344C470397BBA52,
+    0x65D34954DAF3CEBD, 0xB4B81B3FA97511E2, 0xB422061193D6F6A7, 0x071582401C38434D,
+    0x7A13F18BBEDC4FF5, 0xBC4097B116C524D2, 0x59B97885E2F2EA28, 0x99170A5DC3115544,
+    0x6F423357E7C6A9F9, 0x325928EE6E6F8794, 0xD0E4366228B03343, 0x565C31F7DE89EA27,
+    0x30F5611484119414, 0xD873DB391292ED4F, 0x7BD94E1D8E17DEBC, 0xC7D9F16864A76E94,
+    0x947AE053EE56E63C, 0xC8C93882F9475F5F, 0x3A9BF55BA91F81CA, 0xD9A11FBB3D9808E4,
+    0x0FD22063EDC29FCA, 0xB3F256D8ACA0B0B9, 0xB03031A8B4516E84, 0x35DD37D5871448AF,
+    0xE9F6082B05542E4E, 0xEBFAFA33D7254B59, 0x9255ABB50D532280, 0xB9AB4CE57F2D34F3,
+    0x693501D628297551, 0xC62C58F97DD949BF, 0xCD454F8F19C5126A, 0xBBE83F4ECC2BDECB,
+    0xDC842B7E2819E230, 0xBA89142E007503B8, 0xA3BC941D0A5061CB, 0xE9F6760E32CD8021,
+    0x09C7E552BC76492F, 0x852F54934DA55CC9, 0x8107FCCF064FCF56, 0x098954D51FFF6580,
+    0x23B70EDB1955C4BF, 0xC330DE426430F69D, 0x4715ED43E8A45C0A, 0xA8D7E4DAB780A08D,
+    0x0572B974F03CE0BB, 0xB57D2E985E1419C7, 0xE8D9ECBE2CF3D73F, 0x2FE4B17170E59750,
+    0x11317BA87905E790, 0x7FBF21EC8A1F45EC, 0x1725CABFCB045B00, 0x964E915CD5E2B207,
+    0x3E2B8BCBF016D66D, 0xBE7444E39328A0AC, 0xF85B2B4FBCDE44B7, 0x49353FEA39BA63B1,
+    0x1DD01AAFCD53486A, 0x1FCA8A92FD719F85, 0xFC7C95D827357AFA, 0x18A6A990C8B35EBD,
+    0xCCCB7005C6B9C28D, 0x3BDBB92C43B17F26, 0xAA70B5B4F89695A2, 0xE94C39A54A98307F,
+    0xB7A0B174CFF6F36E, 0xD4DBA84729AF48AD, 0x2E18BC1AD9704A68, 0x2DE0966DAF2F8B1C,
+    0xB9C11D5B1E43A07E, 0x64972D68DEE33360, 0x94628D38D0C20584, 0xDBC0D2B6AB90A559,
+    0xD2733C4335C6A72F, 0x7E75D99D94A70F4D, 0x6CED1983376FA72B, 0x97FCAACBF030BC24,
+    0x7B77497B32503B12, 0x8547EDDFB81CCB94, 0x79999CDFF70902CB, 0xCFFE1939438E9B24,
+    0x829626E3892D95D7, 0x92FAE24291F2B3F1, 0x63E22C147B9C3403, 0xC678B6D860284A1C,
+    0x5873888850659AE7, 0x0981DCD296A8736D, 0x9F65789A6509A440, 0x9FF38FED72E9052F,
+    0xE479EE5B9930578C, 0xE7F28ECD2D49EECD, 0x56C074A581EA17FE, 0x5544F7D774B14AEF,
+    0x7B3F0195FC6F290F, 0x12153635B2C0CF57, 0x7F5126DBBA5E0CA7, 0x7A76956C3EAFB413,
+    0x3D5774A11D31AB39, 0x8A1B083821F40CB4, 0x7B4A38E32537DF62, 0x950113646D1D6E03,
+    0x4DA8979A0041E8A9, 0x3BC36E078F7515D7, 0x5D0A12F27AD310D1, 0x7F9D1A2E1EBE1327,
+    0xDA3A361B1C5157B1, 0xDCDD7D20903D0C25, 0x36833336D068F707, 0xCE68341F79893389,
+    0xAB9090168DD05F34, 0x43954B3252DC25E5, 0xB438C2B67F98E5E9, 0x10DCD78E3851A492,
+    0xDBC27AB5447822BF, 0x9B3CDB65F82CA382, 0xB67B7896167B4C84, 0xBFCED1B0048EAC50,
+    0xA9119B60369FFEBD, 0x1FFF7AC80904BF45, 0xAC12FB171817EEE7, 0xAF08DA9177DDA93D,
+    0x1B0CAB936E65C744, 0xB559EB1D04E5E932, 0xC37B45B3F8D6F2BA, 0xC3A9DC228CAAC9E9,
+    0xF3B8B6675A6507FF, 0x9FC477DE4ED681DA, 0x67378D8ECCEF96CB, 0x6DD856D94D259236,
+    0xA319CE15B0B4DB31, 0x073973751F12DD5E, 0x8A8E849EB32781A5, 0xE1925C71285279F5,
+    0x74C04BF1790C0EFE, 0x4DDA48153C94938A, 0x9D266D6A1CC0542C, 0x7440FB816508C4FE,
+    0x13328503DF48229F, 0xD6BF7BAEE43CAC40, 0x4838D65F6EF6748F, 0x1E152328F3318DEA,
+    0x8F8419A348F296BF, 0x72C8834A5957B511, 0xD7A023A73260B45C, 0x94EBC8ABCFB56DAE,
+    0x9FC10D0F989993E0, 0xDE68A2355B93CAE6, 0xA44CFE79AE538BBE, 0x9D1D84FCCE371425,
+    0x51D2B1AB2DDFB636, 0x2FD7E4B9E72CD38C, 0x65CA5B96B7552210, 0xDD69A0D8AB3B546D,
+    0x604D51B25FBF70E2, 0x73AA8A564FB7AC9E, 0x1A8C1E992B941148, 0xAAC40A2703D9BEA0,
+    0x764DBEAE7FA4F3A6, 0x1E99B96E70A9BE8B, 0x2C5E9DEB57EF4743, 0x3A938FEE32D29981,
+    0x26E6DB8FFDF5ADFE, 0x469356C504EC9F9D, 0xC8763C5B08D1908C, 0x3F6C6AF859D80055,
+    0x7F7CC39420A3A545, 0x9BFB227EBDF4C5CE, 0x89039D79D6FC5C5C, 0x8FE88B57305E2AB6,
+    0xA09E8C8C35AB96DE, 0xFA7E393983325753, 0xD6B6D0ECC617C699, 0xDFEA21EA9E7557E3,
+    0xB67C1FA481680AF8, 0xCA1E3785A9E724E5, 0x1CFC8BED0D681639, 0xD18D8549D140CAEA,
+    0x4ED0FE7E9DC91335, 0xE4DBF0634473F5D2, 0x1761F93A44D5AEFE, 0x53898E4C3910DA55,
+    0x734DE8181F6EC39A, 0x2680B122BAA28D97, 0x298AF231C85BAFAB, 0x7983EED3740847D5,
+    0x66C1A2A1A60CD889, 0x9E17E49642A3E4C1, 0xEDB454E7BADC0805, 0x50B704CAB602C329,
+    0x4CC317FB9CDDD023, 0x66B4835D9EAFEA22, 0x219B97E26FFC81BD, 0x261E4E4C0A333A9D,
+    0x1FE2CCA76517DB90, 0xD7504DFA8816EDBB, 0xB9571FA04DC089C8, 0x1DDC0325259B27DE,
+    0xCF3F4688801EB9AA, 0xF4F5D05C10CAB243, 0x38B6525C21A42B0E, 0x36F60E2BA4FA6800,
+    0xEB3593803173E0CE, 0x9C4CD6257C5A3603, 0xAF0C317D32ADAA8A, 0x258E5A80C7204C4B,
+    0x8B889D624D44885D, 0xF4D14597E660F855, 0xD4347F66EC8941C3, 0xE699ED85B0DFB40D,
+    0x2472F6207C2D0484, 0xC2A1E7B5B459AEB5, 0xAB4F6451CC1D45EC, 0x63767572AE3D6174,
+    0xA59E0BD101731A28, 0x116D0016CB948F09, 0x2CF9C8CA052F6E9F, 0x0B090A7560A968E3,
+    0xABEEDDB2DDE06FF1, 0x58EFC10B06A2068D, 0xC6E57A78FBD986E0, 0x2EAB8CA63CE802D7,
+    0x14A195640116F336, 0x7C0828DD624EC390, 0xD74BBE77E6116AC7, 0x804456AF10F5FB53,
+    0xEBE9EA2ADF4321C7, 0x03219A39EE587A30, 0x49787FEF17AF9924, 0xA1E9300CD8520548,
+    0x5B45E522E4B1B4EF, 0xB49C3B3995091A36, 0xD4490AD526F14431, 0x12A8F216AF9418C2,
+    0x001F837CC7350524, 0x1877B51E57A764D5, 0xA2853B80F17F58EE, 0x993E1DE72D36D310,
+    0xB3598080CE64A656, 0x252F59CF0D9F04BB, 0xD23C8E176D113600, 0x1BDA0492E7E4586E,
+    0x21E0BD5026C619BF, 0x3B097ADAF088F94E, 0x8D14DEDB30BE846E, 0xF95CFFA23AF5F6F4,
+    0x3871700761B3F743, 0xCA672B91E9E4FA16, 0x64C8E531BFF53B55, 0x241260ED4AD1E87D,
+    0x106C09B972D2E822, 0x7FBA195410E5CA30, 0x7884D9BC6CB569D8, 0x0647DFEDCD894A29,
+    0x63573FF03E224774, 0x4FC8E9560F91B123, 0x1DB956E450275779, 0xB8D91274B9E9D4FB,
+    0xA2EBEE47E2FBFCE1, 0xD9F1F30CCD97FB09, 0xEFED53D75FD64E6B, 0x2E6D02C36017F67F,
+    0xA9AA4D20DB084E9B, 0xB64BE8D8B25396C1, 0x70CB6AF7C2D5BCF0, 0x98F076A4F7A2322E,
+    0xBF84470805E69B5F, 0x94C3251F06F90CF3, 0x3E003E616A6591E9, 0xB925A6CD0421AFF3,
+    0x61BDD1307C66E300, 0xBF8D5108E27E0D48, 0x240AB57A8B888B20, 0xFC87614BAF287E07,
+    0xEF02CDD06FFDB432, 0xA1082C0466DF6C0A, 0x8215E577001332C8, 0xD39BB9C3A48DB6CF,
+    0x2738259634305C14, 0x61CF4F94C97DF93D, 0x1B6BACA2AE4E125B, 0x758F450C88572E0B,
+    0x959F587D507A8359, 0xB063E962E045F54D, 0x60E8ED72C0DFF5D1, 0x7B64978555326F9F,
+    0xFD080D236DA814BA, 0x8C90FD9B083F4558, 0x106F72FE81E2C590, 0x7976033A39F7D952,
+    0xA4EC0132764CA04B, 0x733EA705FAE4FA77, 0xB4D8F77BC3E56167, 0x9E21F4F903B33FD9,
+    0x9D765E419FB69F6D, 0xD30C088BA61EA5EF, 0x5D94337FBFAF7F5B, 0x1A4E4822EB4D7A59,
+    0x6FFE73E81B637FB3, 0xDDF957BC36D8B9CA, 0x64D0E29EEA8838B3, 0x08DD9BDFD96B9F63,
+    0x087E79E5A57D1D13, 0xE328E230E3E2B3FB, 0x1C2559E30F0946BE, 0x720BF5F26F4D2EAA,
+    0xB0774D261CC609DB, 0x443F64EC5A371195, 0x4112CF68649A260E, 0xD813F2FAB7F5C5CA,
+    0x660D3257380841EE, 0x59AC2C7873F910A3, 0xE846963877671A17, 0x93B633ABFA3469F8,
+    0xC0C0F5A60EF4CDCF, 0xCAF21ECD4377B28C, 0x57277707199B8175, 0x506C11B9D90E8B1D,
+    0xD83CC2687A19255F, 0x4A29C6465A314CD1, 0xED2DF21216235097, 0xB5635C95FF7296E2,
+    0x22AF003AB672E811, 0x52E762596BF68235, 0x9AEBA33AC6ECC6B0, 0x944F6DE09134DFB6,
+    0x6C47BEC883A7DE39, 0x6AD047C430A12104, 0xA5B1CFDBA0AB4067, 0x7C45D833AFF07862,
+    0x5092EF950A16DA0B, 0x9338E69C052B8E7B, 0x455A4B4CFE30E3F5, 0x6B02E63195AD0CF8,
+    0x6B17B224BAD6BF27, 0xD1E0CCD25BB9C169, 0xDE0C89A556B9AE70, 0x50065E535A213CF6,
+    0x9C1169FA2777B874, 0x78EDEFD694AF1EED, 0x6DC93D9526A50E68, 0xEE97F453F06791ED,
+    0x32AB0EDB696703D3, 0x3A6853C7E70757A7, 0x31865CED6120F37D, 0x67FEF95D92607890,
+    0x1F2B1D1F15F6DC9C, 0xB69E38A8965C6B65, 0xAA9119FF184CCCF4, 0xF43C732873F24C13,
+    0xFB4A3D794A9A80D2, 0x3550C2321FD6109C, 0x371F77E76BB8417E, 0x6BFA9AAE5EC05779,
+    0xCD04F3FF001A4778, 0xE3273522064480CA, 0x9F91508BFFCFC14A, 0x049A7F41061A9E60,
+    0xFCB6BE43A9F2FE9B, 0x08DE8A1C7797DA9B, 0x8F9887E6078735A1, 0xB5B4071DBFC73A66,
+    0x230E343DFBA08D33, 0x43ED7F5A0FAE657D, 0x3A88A0FBBCB05C63, 0x21874B8B4D2DBC4F,
+    0x1BDEA12E35F6A8C9, 0x53C065C6C8E63528, 0xE34A1D250E7A8D6B, 0xD6B04D3B7651DD7E,
+    0x5E90277E7CB39E2D, 0x2C046F22062DC67D, 0xB10BB459132D0A26, 0x3FA9DDFB67E2F199,
+    0x0E09B88E1914F7AF, 0x10E8B35AF3EEAB37, 0x9EEDECA8E272B933, 0xD4C718BC4AE8AE5F,
+    0x81536D601170FC20, 0x91B534F885818A06, 0xEC8177F83F900978, 0x190E714FADA5156E,
+    0xB592BF39B0364963, 0x89C350C893AE7DC1, 0xAC042E70F8B383F2, 0xB49B52E587A1EE60,
+    0xFB152FE3FF26DA89, 0x3E666E6F69AE2C15, 0x3B544EBE544C19F9, 0xE805A1E290CF2456,
+    0x24B33C9D7ED25117, 0xE74733427B72F0C1, 0x0A804D18B7097475, 0x57E3306D881EDB4F,
+    0x4AE7D6A36EB5DBCB, 0x2D8D5432157064C8, 0xD1E649DE1E7F268B, 0x8A328A1CEDFE552C,
+    0x07A3AEC79624C7DA, 0x84547DDC3E203C94, 0x990A98FD5071D263, 0x1A4FF12616EEFC89,
+    0xF6F7FD1431714200, 0x30C05B1BA332F41C, 0x8D2636B81555A786, 0x46C9FEB55D120902,
+    0xCCEC0A73B49C9921, 0x4E9D2827355FC492, 0x19EBB029435DCB0F, 0x4659D2B743848A2C,
+    0x963EF2C96B33BE31, 0x74F85198B05A2E7D, 0x5A0F544DD2B1FB18, 0x03727073C2E134B1,
+    0xC7F6AA2DE59AEA61, 0x352787BAA0D7C22F, 0x9853EAB63B5E0B35, 0xABBDCDD7ED5C0860,
+    0xCF05DAF5AC8D77B0, 0x49CAD48CEBF4A71E, 0x7A4C10EC2158C4A6, 0xD9E92AA246BF719E,
+    0x13AE978D09FE5557, 0x730499AF921549FF, 0x4E4B705B92903BA4, 0xFF577222C14F0A3A,
+    0x55B6344CF97AAFAE, 0xB862225B055B6960, 0xCAC09AFBDDD2CDB4, 0xDAF8E9829FE96B5F,
+    0xB5FDFC5D3132C498, 0x310CB380DB6F7503, 0xE87FBB46217A360E, 0x2102AE466EBB1148,
+    0xF8549E1A3AA5E00D, 0x07A69AFDCC42261A, 0xC4C118BFE78FEAAE, 0xF9F4892ED96BD438,
+    0x1AF3DBE25D8F45DA, 0xF5B4B0B0D2DEEEB4, 0x962ACEEFA82E1C84, 0x046E3ECAAF453CE9,
+    0xF05D129681949A4C, 0x964781CE734B3C84, 0x9C2ED44081CE5FBD, 0x522E23F3925E319E,
+    0x177E00F9FC32F791, 0x2BC60A63A6F3B3F2, 0x222BBFAE61725606, 0x486289DDCC3D6780,
+    0x7DC7785B8EFDFC80, 0x8AF38731C02BA980, 0x1FAB64EA29A2DDF7, 0xE4D9429322CD065A,
+    0x9DA058C67844F20C, 0x24C0E332B70019B0, 0x233003B5A6CFE6AD, 0xD586BD01C5C217F6,
+    0x5E5637885F29BC2B, 0x7EBA726D8C94094B, 0x0A56A5F0BFE39272, 0xD79476A84EE20D06,
+    0x9E4C1269BAA4BF37, 0x17EFEE45B0DEE640, 0x1D95B0A5FCF90BC6, 0x93CBE0B699C2585D,
+    0x65FA4F227A2B6D79, 0xD5F9E858292504D5, 0xC2B5A03F71471A6F, 0x59300222B4561E00,
+    0xCE2F8642CA0712DC, 0x7CA9723FBB2E8988, 0x2785338347F2BA08, 0xC61BB3A141E50E8C,
+    0x150F361DAB9DEC26, 0x9F6A419D382595F4, 0x64A53DC924FE7AC9, 0x142DE49FFF7A7C3D,
+    0x0C335248857FA9E7, 0x0A9C32D5EAE45305, 0xE6C42178C4BBB92E, 0x71F1CE2490D20B07,
+    0xF1BCC3D275AFE51A, 0xE728E8C83C334074, 0x96FBF83A12884624, 0x81A1549FD6573DA5,
+    0x5FA7867CAF35E149, 0x56986E2EF3ED091B, 0x917F1DD5F8886C61, 0xD20D8C88C8FFE65F,
+    0x31D71DCE64B2C310, 0xF165B587DF898190, 0xA57E6339DD2CF3A0, 0x1EF6E6DBB1961EC9,
+    0x70CC73D90BC26E24, 0xE21A6B35DF0C3AD7, 0x003A93D8B2806962, 0x1C99DED33CB890A1,
+    0xCF3145DE0ADD4289, 0xD0E4427A5514FB72, 0x77C621CC9FB3A483, 0x67A34DAC4356550B,
+    0xF8D626AAAF278509
+};
+
+static const int POLYGLOT_TYPE[6] = {0, 3, 1, 2, 4, 5}; // our P R N B Q K -> Polyglot P N B R Q K
+
+U64 ffp_polyglot_key(const Position *pos){
+    U64 k=0;
+    for (int p=0;p<PIECE_N;p++){
+        int kind = 2*POLYGLOT_TYPE[type_of_piece(p)] + (p<BP);
+        for (U64 b=pos->bb[p]; b; b&=b-1){
+            int sq=LSB_INDEX(b);
+            k ^= POLYGLOT_RANDOM[64*kind + 8*(7-sq/8) + sq%8];
+        }
+    }
+    for (int i=0;i<4;i++) if (pos->castling & (1<<i)) k ^= POLYGLOT_RANDOM[768+i];
+    // The en-passant file only counts when a pawn of the side to move can take
+    if (pos->ep_square>=0){
+        U64 ep = 1ULL<<pos->ep_square;
+        U64 takers = pos->side==WHITE ? black_pawn_attacks(ep) & pos->bb[WP] : white_pawn_attacks(ep) & pos->bb[BP];
+        if (takers) k ^= POLYGLOT_RANDOM[772 + pos->ep_square%8];
+    }
+    if (pos->side==WHITE) k ^= POLYGLOT_RANDOM[780];
+    return k;
+}
+
+static inline uint64_t get_be(const uint8_t *p, int n){ uint64_t v=0; for (int i=0;i<n;i++) v=v<<8|p[i]; return v; }
+
+bool ffp_book_open(PolyglotBook *book, const char *path){
+    memset(book, 0, sizeof(*book));
+    if (!ffp_file_map(&book->file, path)) return false;
+    if (book->file.size % 16){ ffp_file_unmap(&book->file); return false; }
+    book->entries = (const uint8_t*)book->file.data;
+    book->count = book->file.size/16;
+    if (book->file.mapped) posix_madvise((void*)book->file.data, book->file.size, POSIX_MADV_RANDOM);
+    return true;
+}
+
+void ffp_book_close(PolyglotBook *book){
+    ffp_file_unmap(&book->file);
+    memset(book, 0, sizeof(*book));
+}
+
+// Polyglot moves are from/to/promotion with castling written as king takes rook
+static bool book_move(const Position *pos, uint16_t pm, Move *out){
+    int to = (7-((pm>>3)&7))*8 + (pm&7), from = (7-((pm>>9)&7))*8 + ((pm>>6)&7);
+    static const char PROMO[5] = {0, 'n', 'b', 'r', 'q'};
+    int promo = (pm>>12)&7;
+    if (promo>4) return false;
+    int king = piece_on(pos, from);
+    if ((king==WK || king==BK) && (from==60 || from==4) && piece_on(pos, to)==(king==WK ? WR : BR))
+        to = to>from ? from+2 : from-2;
+    char uci[6] = {'a'+from%8, '8'-from/8, 'a'+to%8, '8'-to/8, PROMO[promo], 0};
+    return ffp_move_from_string(pos, uci, out);
+}
+
+int ffp_book_probe(const PolyglotBook *book, const Position *pos, Move *moves, uint16_t *weights, int max){
+    if (!book || !book->count) return 0;
+    U64 key = ffp_polyglot_key(pos);
+    size_t lo=0, hi=book->count;
+    while (lo<hi){
+        size_t mid=lo+(hi-lo)/2;
+        if (get_be(book->entries+16*mid, 8) < key) lo=mid+1; else hi=mid;
+    }
+    int n=0;
+    for (size_t i=lo; i<book->count && n<max; i++){
+        const uint8_t *e = book->entries+16*i;
+        if (get_be(e, 8)!=key) break;
+        if (!book_move(pos, (uint16_t)get_be(e+8, 2), &moves[n])) continue;
+        weights[n++] = (uint16_t)get_be(e+10, 2);
+    }
+    return n;
+}
+
+bool ffp_book_pick(const PolyglotBook *book, const Position *pos, uint64_t *rng, Move *out){
+    Move moves[64]; uint16_t weights[64];
+    int n = ffp_book_probe(book, pos, moves, weights, 64);
+    uint64_t total=0;
+    for (int i=0;i<n;i++) total += weights[i];
+    if (!total) return false;
+    uint64_t r = splitmix64(rng) % total;
+    for (int i=0;i<n;i++){
+        if (r < weights[i]){ *out = moves[i]; return true; }
+        r -= weights[i];
+    }
+    return false;
+}
+
 // Printing
 void ffp_print_board(const Position *pos){
     printf("\n");
@@ -823,21 +2673,90 @@ void ffp_print_board(const Position *pos){
     }
     printf("  a b c d e f g h\n\n");
 }
+
+#ifndef FFP_NO_MAIN             // library builds (make lib) stop here
+
 static void print_move(const Move m){
     char buf[6];
     ffp_move_to_string(&m, buf);
     printf("%s", buf);
 }
 
+#ifdef FFP_STATS
+// One line per iteration; prefix is "info string " for UCI
+static void search_stats_print(FILE *f, const SearchStats *s, const char *prefix){
+    fprintf(f, "%s%5s %12s %6s %7s %7s %8s %8s\n", prefix, "depth", "nodes", "ebf", "tt hit", "tt cut", "1st cut", "seldepth");
+    for (int d=1; d<=s->depths; d++){
+        const SearchDepthStats *x=&s->depth[d];
+        double ebf = d>1 && s->depth[d-1].nodes ? (double)x->nodes/s->depth[d-1].nodes : 0;
+        fprintf(f, "%s%5d %12llu %6.2f %6.1f%% %6.1f%% %7.1f%% %8d\n", prefix, d, (unsigned long long)x->nodes, ebf,
+                x->tt_probes ? 100.0*x->tt_hits/x->tt_probes : 0, x->tt_probes ? 100.0*x->tt_cutoffs/x->tt_probes : 0,
+                x->cutoffs ? 100.0*x->first_cutoffs/x->cutoffs : 0, x->seldepth);
+    }
+}
+#endif
+
 // UCI loop (minimal)
+static void uci_info(const SearchResult *res, void *user){
+    (void)user;
+    char score[24], mv[6];
+    if (res->score >= MATE_BOUND) snprintf(score, sizeof(score), "mate %d", (MATE_SCORE-res->score+1)/2);
+    else if (res->score <= -MATE_BOUND) snprintf(score, sizeof(score), "mate -%d", (MATE_SCORE+res->score)/2);
+    else snprintf(score, sizeof(score), "cp %d", res->score);
+    printf("info depth %d score %s nodes %llu nps %.0f time %.0f pv", res->depth_reached, score,
+           (unsigned long long)res->nodes, res->seconds>0 ? res->nodes/res->seconds : 0, res->seconds*1000.0);
+    for (int i=0;i<res->pv_length;i++){ ffp_move_to_string(&res->pv[i], mv); printf(" %s", mv); }
+    printf("\n"); fflush(stdout);
+}
+
+static void uci_id(void){
+    printf("id name ffp\nid author you\n");
+    printf("option name OwnBook type check default false\n");
+    printf("option name BookFile type string default <empty>\n");
+    printf("option name Hash type spin default 16 min 1 max 65536\n");
+    printf("option name Threads type spin default 1 min 1 max 512\n");
+    printf("option name Affinity type combo default none var none var cpu var node\n");
+    printf("option name SharedHash type string default <empty>\n");
+    printf("uciok\n"); fflush(stdout);
+}
+
 static void uci_loop(void){
     char line[4096];
     Position pos; set_from_fen(&pos, FFP_FEN_STARTPOS);
-    printf("id name ffp\nid author you\nuciok\n"); fflush(stdout);
+    PolyglotBook book = {0};
+    bool own_book = false;
+    uint64_t book_rng = (uint64_t)(wall_seconds()*1e9);
+    FfpEngine *engine = ffp_engine_create(NULL);
+    if (!engine){ printf("info string cannot create engine\n"); return; }
+    uci_id();
     while (fgets(line,sizeof(line),stdin)){
-        if      (!strncmp(line,"uci",3))      { printf("id name ffp\nid author you\nuciok\n"); fflush(stdout); }
+        if      (!strncmp(line,"ucinewgame",10)){ set_from_fen(&pos, FFP_FEN_STARTPOS); ffp_engine_new_game(engine); }
+        else if (!strncmp(line,"uci",3))      { uci_id(); }
         else if (!strncmp(line,"isready",7))  { printf("readyok\n"); fflush(stdout); }
-        else if (!strncmp(line,"ucinewgame",10)){ set_from_fen(&pos, FFP_FEN_STARTPOS); }
+        else if (!strncmp(line,"setoption",9)){
+            char *name=strstr(line,"name "), *value=strstr(line," value ");
+            if (!name) continue;
+            name+=5;
+            if (value){ *value=0; value+=7; value[strcspn(value,"\r\n")]=0; }
+            if (!strcmp(name,"OwnBook")) own_book = value && !strcmp(value,"true");
+            else if (!strcmp(name,"BookFile")){
+                ffp_book_close(&book);
+                if (value && *value && strcmp(value,"<empty>") && !ffp_book_open(&book, value))
+                    printf("info string cannot open book %s\n", value);
+                else if (book.count) printf("info string book %s: %zu entries\n", value, book.count);
+                fflush(stdout);
+            }
+            else if (!strcmp(name,"Hash") || !strcmp(name,"SharedHash")){
+                const HashTable *tt = ffp_engine_hash(engine);
+                if (ffp_engine_set_option(engine, name, value))
+                    printf("info string hash %zu MB, %s%s\n", tt->bytes>>20, ffp_hash_pages(tt), tt->segment ? ", shared" : "");
+                else if (name[0]=='H') printf("info string cannot allocate %s MB hash\n", value ? value : "?");
+                else if (errno==ESTALE && value) printf("info string shared hash %s is a stale object left by a crashed creator; remove /dev/shm/%s\n", value, value+(*value=='/'));
+                else printf("info string cannot attach shared hash %s\n", value ? value : "?");
+                fflush(stdout);
+            }
+            else ffp_engine_set_option(engine, name, value);  // Threads starts the pool threads now, not on the first go
+        }
         else if (!strncmp(line,"position",8)){
             char *ptr=line+8; while(*ptr==' ') ptr++;
             if (!strncmp(ptr,"startpos",8)){ set_from_fen(&pos, FFP_FEN_STARTPOS); ptr+=8; }
@@ -876,6 +2795,13 @@ static void uci_loop(void){
             }
         }
         else if (!strncmp(line,"go",2)){
+            Move bm;
+            char buf[6];
+            if (own_book && ffp_book_pick(&book, &pos, &book_rng, &bm)){
+                ffp_move_to_string(&bm, buf);
+                printf("info string book move\nbestmove %s\n", buf); fflush(stdout);
+                continue;
+            }
             SearchLimits limits = {0};
             char *dpos=strstr(line,"depth");
             if (dpos){
@@ -892,8 +2818,15 @@ static void uci_loop(void){
                 unsigned long long nodes=strtoull(npos+5, NULL, 10);
                 limits.node_limit = nodes;
             }
-            SearchResult res = ffp_search(&pos, &limits);
-            char buf[6];
+#ifdef FFP_STATS
+            SearchStats stats = {0};
+            limits.stats = &stats;
+#endif
+            SearchCallbacks cb = { .iteration = uci_info };
+            SearchResult res = ffp_engine_search(engine, &pos, &limits, &cb);
+#ifdef FFP_STATS
+            search_stats_print(stdout, &stats, "info string ");
+#endif
             ffp_move_to_string(&res.best_move, buf);
             if (buf[0]==0) strcpy(buf, "0000");
             printf("bestmove %s\n", buf); fflush(stdout);
@@ -905,6 +2838,8 @@ static void uci_loop(void){
         }
         else if (!strncmp(line,"quit",4)) break;
     }
+    ffp_book_close(&book);
+    ffp_engine_destroy(engine);
 }
 
 // CLI
@@ -916,46 +2851,2540 @@ static void usage(void){
     printf("  ./ffp --perft N        # perft to depth N\n");
     printf("  ./ffp --search N       # search depth N and print best move\n");
     printf("  ./ffp --search-time MS # search with time limit in ms\n");
-    printf("  ./ffp --uci            # start minimal UCI loop\n\n");
+    printf("  ./ffp --search-stats   # with --search/--search-time/bench: per-depth counters (make stats)\n");
+    printf("  ./ffp --profile        # print hot-path call counts and cycles at exit (make profile)\n");
+    printf("  ./ffp --trace FILE     # write a Chrome/Perfetto timeline of the worker threads at exit\n");
+    printf("  ./ffp --threads N      # worker threads for the file commands below, Lazy SMP for --search with --hash\n");
+    printf("  ./ffp --affinity MODE  # pin pool threads: none, cpu or node\n");
+    printf("  ./ffp --epd FILE       # load and validate every position of an EPD/FEN file\n");
+    printf("  ./ffp --pgn FILE       # replay every game of a PGN file and report games/s\n");
+    printf("  ./ffp --analyse FILE   # search every EPD position, CSV/JSON lines in input order\n");
+    printf("  ./ffp --solve FILE     # run an EPD test suite (bm/am), report time to solution\n");
+    printf("  ./ffp --serve SOCKET   # answer search/eval/legal/perft lines over a Unix socket (--threads workers)\n");
+    printf("  ./ffp --jsonl          # JSON request per stdin line, replies as they finish (--ordered: input order)\n");
+    printf("  ./ffp --pack IN OUT    # convert EPD/FEN to packed 32-byte records\n");
+    printf("  ./ffp --datagen OUT    # self-play games to packed records (--games, --nodes, --random-plies, --seed)\n");
+    printf("  ./ffp --tune FILE      # Texel-tune the evaluation weights on packed records (--epochs, --lr)\n");
+    printf("  ./ffp --dedupe IN OUT  # drop duplicate packed positions (--mirror folds colour flips, --memory MB)\n");
+    printf("  ./ffp --book-build PGN OUT # Polyglot book from games (--max-ply N, --min-games K, --memory MB)\n");
+    printf("  ./ffp bench [depth] [threads] [hash] # fixed search benchmark: node signature and NPS\n");
+    printf("  ./ffp --perft-suite    # perft on known positions, checks node counts, reports Mnps\n");
+    printf("  Benchmarks accept --bench-runs N --bench-save FILE --bench-compare FILE --bench-threshold PCT\n");
+    printf("  ./ffp --unpack FILE    # print packed records as EPD\n");
+    printf("  ./ffp --uci            # start minimal UCI loop\n");
+    printf("Settings (anywhere on the line): --threads N --depth N --nodes N --movetime MS\n");
+    printf("  --hash MB (per worker) --format csv|json --shared-hash NAME (one table shared by processes)\n\n");
 }
 
-int main(int argc,char **argv){
-    Position pos; set_from_fen(&pos, FFP_FEN_STARTPOS);
-    if (argc==1){
-        ffp_print_board(&pos);
-        SearchLimits limits = {.max_depth=4};
-        SearchResult res = ffp_search(&pos, &limits);
-        Move best=res.best_move;
-        printf("Suggest: "); print_move(best); printf(" (depth 4)\n");
-        return 0;
+static int cmd_epd(const char *path, int threads){
+    EpdStats st;
+    if (!ffp_epd_load(path, threads, NULL, NULL, &st)){ fprintf(stderr, "cannot read %s\n", path); return 1; }
+    double sec = st.seconds;
+    printf("epd: %llu positions, %llu errors  (%.3fs, %.0f kpos/s, %.0f MB/s)\n",
+           (unsigned long long)st.records, (unsigned long long)st.errors, sec,
+           sec>0?(st.records/1000.0/sec):0, sec>0?(st.bytes/1e6/sec):0);
+    return st.errors ? 1 : 0;
+}
+
+typedef struct { PackedWriter out; uint64_t skipped; } PackJob;
+
+static bool pack_record(const EpdRecord *rec, void *user){
+    PackJob *job=(PackJob*)user;
+    PackedInfo info={0};
+    const EpdOp *op;
+    char buf[16];
+    if ((op=ffp_epd_find_op(rec, "ce")) && op->value_len<(int)sizeof(buf)){
+        memcpy(buf, op->value, op->value_len); buf[op->value_len]=0;
+        long cp = strtol(buf, NULL, 10);
+        if (rec->pos.side==BLACK) cp=-cp;
+        info.score = (int16_t)(cp>32767 ? 32767 : cp<-32767 ? -32767 : cp);
+        info.has_score = true;
     }
-    for (int i=1;i<argc;i++){
-        if (!strcmp(argv[i],"--help")) { usage(); return 0; }
-        else if (!strcmp(argv[i],"--uci")) { uci_loop(); return 0; }
-        else if (!strcmp(argv[i],"--fen") && i+1<argc) { ffp_position_from_fen(&pos, argv[++i]); }
-        else if (!strcmp(argv[i],"--perft") && i+1<argc){
-            int depth=atoi(argv[++i]);
-            clock_t t0=clock(); uint64_t nodes=perft(&pos, depth);
-            double sec=(double)(clock()-t0)/CLOCKS_PER_SEC;
-            printf("perft(%d) = %llu  (%.3fs, %.0f kn/s)\n", depth, (unsigned long long)nodes, sec, sec>0?(nodes/1000.0/sec):0);
-            return 0;
+    if ((op=ffp_epd_find_op(rec, "c9"))) info.result = (uint8_t)parse_result(op->value, op->value_len);
+    if ((op=ffp_epd_find_op(rec, "sm")) && op->value_len<(int)sizeof(buf)){
+        Move m;
+        memcpy(buf, op->value, op->value_len); buf[op->value_len]=0;
+        if (ffp_move_from_san(&rec->pos, buf, &m) || ffp_move_from_string(&rec->pos, buf, &m)) info.move = ffp_move_pack(&m);
+    }
+    PackedPosition pp;
+    if (!ffp_position_pack(&rec->pos, &info, &pp)){ job->skipped++; return true; }
+    return ffp_packed_writer_write(&job->out, &pp, 1);
+}
+
+static int cmd_pack(const char *in, const char *out){
+    PackJob job={0};
+    if (!ffp_packed_writer_open(&job.out, out)){ fprintf(stderr, "cannot write %s\n", out); return 1; }
+    EpdStats st;
+    bool ok = ffp_epd_load(in, 1, pack_record, &job, &st);
+    uint64_t written = job.out.written;
+    ok = ffp_packed_writer_close(&job.out) && ok;
+    if (!ok){ fprintf(stderr, "packing %s failed\n", in); return 1; }
+    printf("packed %llu positions (%llu errors, %llu skipped): %zu -> %llu bytes\n",
+           (unsigned long long)written, (unsigned long long)st.errors, (unsigned long long)job.skipped,
+           st.bytes, (unsigned long long)written*FFP_PACKED_SIZE);
+    return 0;
+}
+
+static int cmd_unpack(const char *path){
+    PackedReader r;
+    if (!ffp_packed_reader_open(&r, path)){ fprintf(stderr, "cannot read %s\n", path); return 1; }
+    Position pos; PackedInfo info; char fen[128], mv[8];
+    while (ffp_packed_reader_next(&r, &pos, &info)){
+        ffp_position_to_fen(&pos, fen, sizeof(fen));
+        fputs(fen, stdout);
+        if (info.has_score) printf(" ce %d;", pos.side==WHITE ? info.score : -info.score);
+        if (info.result) printf(" c9 \"%s\";", RESULT_STR[info.result]);
+        Move m;
+        if (ffp_move_unpack(&pos, info.move, &m)){ ffp_move_to_san(&pos, &m, mv); printf(" sm %s;", mv); }
+        fputc('\n', stdout);
+    }
+    ffp_packed_reader_close(&r);
+    return 0;
+}
+
+static int cmd_pgn(const char *path, int threads){
+    PgnStats st;
+    if (!ffp_pgn_read_file(path, threads, NULL, &st)){ fprintf(stderr, "cannot read %s\n", path); return 1; }
+    double sec = st.seconds;
+    printf("pgn: %llu games, %llu moves, %llu errors  (%.3fs, %.0f games/s, %.0f MB/s)\n",
+           (unsigned long long)st.games, (unsigned long long)st.moves, (unsigned long long)st.errors, sec,
+           sec>0?(st.games/sec):0, sec>0?(st.bytes/1e6/sec):0);
+    return st.errors ? 1 : 0;
+}
+
+// Settings may appear anywhere on the command line; they are read before any command runs
+typedef struct {
+    int threads;
+    int depth;                  // 0 = engine default, or unlimited with --nodes/--movetime
+    int movetime;
+    uint64_t nodes;
+    int hash_mb;
+    bool json;
+    uint64_t games;             // --datagen: games to play
+    int random_plies;           // --datagen: random opening moves, -1 = default
+    uint64_t seed;              // 0 = derived from the clock
+    bool mirror;                // --dedupe: fold colour-flipped positions together
+    bool ordered;               // --jsonl: replies in request order
+    bool search_stats;          // --search, --search-time, bench: print per-depth counters
+    bool profile;               // print hot-path timers at exit
+    const char *trace;          // Chrome trace-event JSON written at exit
+    const char *shared_hash;    // --search, --analyse, --serve, --jsonl: shared-memory table name
+    int affinity;               // AFFINITY_* for the pool threads
+    int memory_mb;              // --dedupe, --book-build: in-memory budget before spilling
+    const char *bench_save;     // benchmarks: write results as JSON
+    const char *bench_compare;  // benchmarks: compare against a saved JSON baseline
+    int bench_runs;             // benchmarks: repetitions (default 1, or 5 with save/compare)
+    double bench_threshold;     // benchmarks: slowdown in percent that fails a compare, -1 = 3%
+    int max_ply;                // --book-build: plies per game to record
+    int min_games;              // --book-build: minimum games per (position, move)
+    int epochs;                 // --tune: optimiser steps
+    double lr;                  // --tune: Adam learning rate (centipawns per step)
+} CliOptions;
+
+static bool cli_setting(CliOptions *o, int argc, char **argv, int *i){
+    const char *a=argv[*i];
+    if (!strcmp(a,"--mirror")) { o->mirror=true; return true; }
+    if (!strcmp(a,"--ordered")) { o->ordered=true; return true; }
+    if (!strcmp(a,"--search-stats")) { o->search_stats=true; return true; }
+    if (!strcmp(a,"--profile")) { o->profile=true; return true; }
+    if (*i+1>=argc) return false;
+    if      (!strcmp(a,"--threads"))  { o->threads=atoi(argv[++*i]); if (o->threads<1) o->threads=1; }
+    else if (!strcmp(a,"--depth"))    { o->depth=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--movetime")) { o->movetime=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--nodes"))    { o->nodes=strtoull(argv[++*i], NULL, 10); }
+    else if (!strcmp(a,"--hash"))     { o->hash_mb=atoi(argv[++*i]); if (o->hash_mb<0) o->hash_mb=0; }
+    else if (!strcmp(a,"--format"))   { o->json=!strcmp(argv[++*i],"json"); }
+    else if (!strcmp(a,"--games"))    { o->games=strtoull(argv[++*i], NULL, 10); }
+    else if (!strcmp(a,"--random-plies")) { o->random_plies=atoi(argv[++*i]); if (o->random_plies<0) o->random_plies=0; }
+    else if (!strcmp(a,"--seed"))     { o->seed=strtoull(argv[++*i], NULL, 0); }
+    else if (!strcmp(a,"--memory"))   { o->memory_mb=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--bench-save"))    { o->bench_save=argv[++*i]; }
+    else if (!strcmp(a,"--bench-compare")) { o->bench_compare=argv[++*i]; }
+    else if (!strcmp(a,"--bench-runs"))    { o->bench_runs=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--bench-threshold")) { o->bench_threshold=atof(argv[++*i]); }
+    else if (!strcmp(a,"--max-ply"))  { o->max_ply=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--min-games")) { o->min_games=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--epochs"))   { o->epochs=atoi(argv[++*i]); }
+    else if (!strcmp(a,"--lr"))       { o->lr=atof(argv[++*i]); }
+    else if (!strcmp(a,"--trace"))    { o->trace=argv[++*i]; }
+    else if (!strcmp(a,"--shared-hash")) { o->shared_hash=argv[++*i]; }
+    else if (!strcmp(a,"--affinity")) { const char *v=argv[++*i]; o->affinity = !strcmp(v,"cpu") ? AFFINITY_CPU : !strcmp(v,"node") ? AFFINITY_NODE : AFFINITY_NONE; }
+    else return false;
+    return true;
+}
+
+static SearchLimits cli_limits(const CliOptions *o){
+    SearchLimits limits = {0};
+    limits.max_depth = o->depth>0 ? o->depth : (o->nodes || o->movetime) ? FFP_MAX_PLY-1 : 0;
+    limits.node_limit = o->nodes;
+    limits.time_ms = o->movetime;
+    return limits;
+}
+
+// --hash MB, or with --shared-hash NAME the table shared with other processes
+static bool cli_hash(HashTable *tt, const CliOptions *o){
+    if (!o->shared_hash) return o->hash_mb>0 && ffp_hash_init(tt, (size_t)o->hash_mb);
+    if (ffp_hash_attach(tt, o->shared_hash, (size_t)(o->hash_mb>0 ? o->hash_mb : 16))) return true;
+    if (errno==ESTALE) fprintf(stderr, "shared hash %s is a stale object left by a crashed creator; remove /dev/shm/%s\n", o->shared_hash, o->shared_hash+(*o->shared_hash=='/'));
+    else fprintf(stderr, "cannot attach shared hash %s\n", o->shared_hash);
+    return false;
+}
+
+// --trace: the rings are written once, at exit
+static const char *trace_path;
+
+static void trace_write(void){
+    FILE *f = fopen(trace_path, "w");
+    if (!f){ fprintf(stderr, "cannot write trace %s\n", trace_path); return; }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    uint64_t events=0, dropped=0;
+    bool first=true;
+    for (TraceRing *r=atomic_load(&trace_rings); r; r=r->next){
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",\n", r->tid, r->tid ? "thread" : "main", r->tid);
+        first=false;
+        uint64_t n = r->head<TRACE_RING ? r->head : TRACE_RING;
+        dropped += r->head-n;
+        for (uint64_t k=r->head-n; k<r->head; k++){
+            const TraceEvent *e=&r->ev[k % TRACE_RING];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", e->name, e->ph, r->tid, e->ts/1000.0);
+            if (e->ph=='X') fprintf(f, ",\"dur\":%.3f", e->dur/1000.0);
+            else fprintf(f, ",\"s\":\"t\"");
+            if (e->arg_name){
+                if (e->text[0]) fprintf(f, ",\"args\":{\"%s\":%lld,\"move\":\"%s\"}", e->arg_name, (long long)e->arg, e->text);
+                else fprintf(f, ",\"args\":{\"%s\":%lld}", e->arg_name, (long long)e->arg);
+            }
+            fputc('}', f);
+            events++;
         }
-        else if (!strcmp(argv[i],"--search") && i+1<argc){
-            int depth=atoi(argv[++i]);
-            SearchLimits limits = {.max_depth = depth>0?depth:4};
-            SearchResult res = ffp_search(&pos, &limits);
-            Move best=res.best_move;
-            printf("best move: "); print_move(best); printf("\n"); return 0;
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f)!=0) fprintf(stderr, "cannot write trace %s\n", trace_path);
+    else fprintf(stderr, "trace: %llu events (%llu overwritten) -> %s\n", (unsigned long long)events, (unsigned long long)dropped, trace_path);
+}
+
+// --trace: events are recorded from here on and written at exit
+static void trace_start(const char *path){
+    trace_path = path;
+    trace_t0 = wall_seconds();
+    trace_on = true;
+    atexit(trace_write);
+}
+
+// --profile: printed at exit; the timers only exist in FFP_PROFILE builds (make profile)
+static void cli_profile_report(void){
+#ifdef FFP_PROFILE
+    static const char *names[PROF_COUNT] = {"movegen (pseudo-legal)", "legal filter", "make", "unmake", "attack test", "evaluate"};
+    const char *unit = cycle_count() ? "cycles" : "ns";
+    fflush(stdout);
+    prof_flush();
+    // Cost of one empty scope, which every count below includes
+    uint64_t overhead = UINT64_MAX;
+    for (int i=0;i<1000;i++){ uint64_t a=prof_clock(), b=prof_clock(); if (b-a<overhead) overhead=b-a; }
+    fprintf(stderr, "%-24s %14s %16s %12s\n", "scope (inclusive)", "calls", unit, "per call");
+    for (int i=0;i<PROF_COUNT;i++){
+        uint64_t c=prof_total.calls[i], t=prof_total.ticks[i];
+        fprintf(stderr, "%-24s %14llu %16llu %12.1f\n", names[i], (unsigned long long)c, (unsigned long long)t, c ? (double)t/c : 0);
+    }
+    fprintf(stderr, "timer overhead ~%llu %s per call\n", (unsigned long long)overhead, unit);
+#else
+    fprintf(stderr, "profiling is compiled out; rebuild with make profile\n");
+#endif
+}
+
+// The counters only exist in FFP_STATS builds (make stats)
+static void cli_search_stats(const SearchStats *s){
+#ifdef FFP_STATS
+    search_stats_print(stdout, s, "");
+#else
+    (void)s;
+    fprintf(stderr, "search statistics are compiled out; rebuild with make stats\n");
+#endif
+}
+
+static void put_json_string(FILE *f, const char *s, int len){
+    fputc('"', f);
+    for (int i=0;i<len;i++){
+        unsigned char c=(unsigned char)s[i];
+        if (c=='"' || c=='\\') fprintf(f, "\\%c", c);
+        else if (c<0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Batch modes: one search per EPD line on a worker pool, output in input order
+typedef struct {
+    Position pos;
+    const char *id, *bm, *am;   // EPD opcode values, not NUL-terminated
+    int id_len, bm_len, am_len;
+    char *out;                  // formatted result, NULL until done
+    bool solved;
+    double solve_ms;
+    uint64_t solve_nodes;
+} BatchItem;
+
+typedef struct {
+    BatchItem *items;
+    size_t count;
+    atomic_size_t next;
+    pthread_mutex_t lock;
+    size_t printed;
+    const CliOptions *opt;
+    MappedFile file;
+} BatchJob;
+
+static bool batch_load(BatchJob *job, const char *path, const CliOptions *opt){
+    memset(job, 0, sizeof(*job));
+    if (!ffp_file_map(&job->file, path)){ fprintf(stderr, "cannot read %s\n", path); return false; }
+    size_t cap=0, cursor=0; uint64_t errors=0;
+    EpdRecord rec;
+    while (ffp_epd_next(job->file.data, job->file.size, &cursor, &rec, &errors)){
+        if (job->count==cap){
+            BatchItem *n = realloc(job->items, sizeof(BatchItem)*(cap = cap ? cap*2 : 1024));
+            if (!n){ free(job->items); ffp_file_unmap(&job->file); return false; }
+            job->items = n;
         }
-        else if (!strcmp(argv[i],"--search-time") && i+1<argc){
-            int ms=atoi(argv[++i]);
-            SearchLimits limits = {.time_ms = ms>0?ms:0};
-            SearchResult res = ffp_search(&pos, &limits);
-            Move best=res.best_move;
-            printf("best move: "); print_move(best); printf("\n"); return 0;
+        BatchItem *it = &job->items[job->count++];
+        memset(it, 0, sizeof(*it));
+        it->pos = rec.pos;
+        const EpdOp *op;
+        if ((op=ffp_epd_find_op(&rec, "id"))){ it->id=op->value; it->id_len=op->value_len; }
+        if ((op=ffp_epd_find_op(&rec, "bm"))){ it->bm=op->value; it->bm_len=op->value_len; }
+        if ((op=ffp_epd_find_op(&rec, "am"))){ it->am=op->value; it->am_len=op->value_len; }
+    }
+    if (errors) fprintf(stderr, "%s: %llu invalid lines skipped\n", path, (unsigned long long)errors);
+    atomic_init(&job->next, 0);
+    pthread_mutex_init(&job->lock, NULL);
+    job->opt = opt;
+    return true;
+}
+
+static void batch_free(BatchJob *job){
+    pthread_mutex_destroy(&job->lock);
+    free(job->items);
+    ffp_file_unmap(&job->file);
+}
+
+// Stores item i's output and prints the completed prefix
+static void batch_emit(BatchJob *job, size_t i, char *out){
+    pthread_mutex_lock(&job->lock);
+    job->items[i].out = out ? out : strdup("\n");
+    while (job->printed<job->count && job->items[job->printed].out){
+        fputs(job->items[job->printed].out, stdout);
+        free(job->items[job->printed].out);
+        job->items[job->printed++].out = (char*)"";
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static char *format_analysis(const BatchJob *job, size_t index, const SearchResult *res, double ms){
+    const BatchItem *it = &job->items[index];
+    char *buf=NULL; size_t len=0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return NULL;
+    char mv[6];
+    ffp_move_to_string(&res->best_move, mv);
+    if (job->opt->json){
+        fprintf(f, "{\"index\":%zu,\"id\":", index);
+        put_json_string(f, it->id ? it->id : "", it->id_len);
+        fprintf(f, ",\"bestmove\":\"%s\",\"score\":%d,\"depth\":%d,\"nodes\":%llu,\"time_ms\":%.1f,\"pv\":\"",
+                mv, res->score, res->depth_reached, (unsigned long long)res->nodes, ms);
+    } else {
+        fprintf(f, "%zu,", index);
+        if (it->id && (memchr(it->id, ',', it->id_len) || memchr(it->id, '"', it->id_len))){
+            fputc('"', f);
+            for (int i=0;i<it->id_len;i++){ if (it->id[i]=='"') fputc('"', f); fputc(it->id[i], f); }
+            fputc('"', f);
+        } else fwrite(it->id ? it->id : "", 1, it->id ? it->id_len : 0, f);
+        fprintf(f, ",%s,%d,%d,%llu,%.1f,", mv, res->score, res->depth_reached, (unsigned long long)res->nodes, ms);
+    }
+    for (int i=0;i<res->pv_length;i++){ ffp_move_to_string(&res->pv[i], mv); fprintf(f, i?" %s":"%s", mv); }
+    fputs(job->opt->json ? "\"}\n" : "\n", f);
+    fclose(f);
+    return buf;
+}
+
+static void analyse_worker(int worker, void *arg){
+    (void)worker;
+    BatchJob *job=(BatchJob*)arg;
+    HashTable tt;
+    SearchLimits limits = cli_limits(job->opt);
+    if (cli_hash(&tt, job->opt)) limits.hash=&tt;
+    for (;;){
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i>=job->count) break;
+        double t0 = wall_seconds();
+        uint64_t tr = trace_now();
+        SearchResult res = ffp_search(&job->items[i].pos, &limits);
+        TRACE_SPAN("item", tr, "index", (int64_t)i);
+        batch_emit(job, i, format_analysis(job, i, &res, (wall_seconds()-t0)*1000.0));
+    }
+    if (limits.hash) ffp_hash_free(&tt);
+}
+
+static int cmd_analyse(const char *path, const CliOptions *opt){
+    BatchJob job;
+    if (!batch_load(&job, path, opt)) return 1;
+    if (!opt->json) printf("index,id,bestmove,score,depth,nodes,time_ms,pv\n");
+    double t0 = wall_seconds();
+    run_workers(opt->threads, analyse_worker, &job);
+    fflush(stdout);
+    fprintf(stderr, "analysed %zu positions in %.3fs\n", job.count, wall_seconds()-t0);
+    batch_free(&job);
+    return 0;
+}
+
+// Test-suite solver: checks bm/am after every iteration and records when the
+// solution was first found and then held until the end of the search
+#define SOLVE_MAX_MOVES 8
+
+typedef struct {
+    Move bm[SOLVE_MAX_MOVES], am[SOLVE_MAX_MOVES];
+    int bm_count, am_count;
+    double start;
+    bool held;
+    double found_ms;
+    uint64_t found_nodes;
+} SolveState;
+
+static int parse_move_list(const Position *pos, const char *s, int len, Move *out, int max){
+    int n=0;
+    const char *e=s+len;
+    while (s<e && n<max){
+        while (s<e && is_blank(*s)) s++;
+        const char *q=s;
+        while (s<e && !is_blank(*s)) s++;
+        char buf[16];
+        if (s==q || s-q>=(int)sizeof(buf)) continue;
+        memcpy(buf, q, s-q); buf[s-q]=0;
+        if (ffp_move_from_san(pos, buf, &out[n]) || ffp_move_from_string(pos, buf, &out[n])) n++;
+    }
+    return n;
+}
+
+static bool move_in(const Move *m, const Move *list, int n){
+    for (int i=0;i<n;i++) if (list[i].from==m->from && list[i].to==m->to && list[i].promo==m->promo) return true;
+    return false;
+}
+
+static void solve_iteration(const SearchResult *res, void *user){
+    SolveState *st=(SolveState*)user;
+    bool ok = (!st->bm_count || move_in(&res->best_move, st->bm, st->bm_count)) && !move_in(&res->best_move, st->am, st->am_count);
+    if (ok && !st->held){ st->held=true; st->found_ms=(wall_seconds()-st->start)*1000.0; st->found_nodes=res->nodes; }
+    else if (!ok) st->held=false;
+}
+
+static void solve_worker(int worker, void *arg){
+    (void)worker;
+    BatchJob *job=(BatchJob*)arg;
+    HashTable tt;
+    SearchLimits limits = cli_limits(job->opt);
+    if (job->opt->hash_mb>0 && ffp_hash_init(&tt, (size_t)job->opt->hash_mb)) limits.hash=&tt;
+    for (;;){
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i>=job->count) break;
+        BatchItem *it = &job->items[i];
+        uint64_t tr = trace_now();
+        SolveState st = {0};
+        st.bm_count = it->bm ? parse_move_list(&it->pos, it->bm, it->bm_len, st.bm, SOLVE_MAX_MOVES) : 0;
+        st.am_count = it->am ? parse_move_list(&it->pos, it->am, it->am_len, st.am, SOLVE_MAX_MOVES) : 0;
+        char *buf=NULL; size_t len=0;
+        FILE *f = open_memstream(&buf, &len);
+        if (f) fprintf(f, "%4zu %-12.*s ", i+1, it->id ? it->id_len : 1, it->id ? it->id : "-");
+        if (!st.bm_count && !st.am_count){
+            if (f) fprintf(f, "skipped (no usable bm/am)\n");
+        } else {
+            if (limits.hash) ffp_hash_clear(limits.hash);
+            SearchCallbacks cb = { .iteration = solve_iteration, .user = &st };
+            limits.callbacks = &cb;
+            st.start = wall_seconds();
+            Position pos = it->pos;
+            SearchResult res = ffp_search(&pos, &limits);
+            char san[8]; ffp_move_to_san(&it->pos, &res.best_move, san);
+            it->solved = st.held;
+            it->solve_ms = st.found_ms;
+            it->solve_nodes = st.found_nodes;
+            if (f){
+                if (st.held) fprintf(f, "solved  %9.1f ms %12llu nodes", st.found_ms, (unsigned long long)st.found_nodes);
+                else         fprintf(f, "FAILED  %9s    %12s      ", "", "");
+                fprintf(f, "  best %-7s", san);
+                if (it->bm) fprintf(f, "  bm %.*s", it->bm_len, it->bm);
+                if (it->am) fprintf(f, "  am %.*s", it->am_len, it->am);
+                fputc('\n', f);
+            }
+        }
+        if (f) fclose(f);
+        TRACE_SPAN("item", tr, "index", (int64_t)i);
+        batch_emit(job, i, buf);
+    }
+    if (limits.hash) ffp_hash_free(&tt);
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x=*(const double*)a, y=*(const double*)b;
+    return (x>y)-(x<y);
+}
+
+static int cmd_solve(const char *path, const CliOptions *opt){
+    BatchJob job;
+    if (!batch_load(&job, path, opt)) return 1;
+    if (!opt->movetime && !opt->nodes && !opt->depth) fprintf(stderr, "no limit given, searching with the default depth\n");
+    run_workers(opt->threads, solve_worker, &job);
+    size_t solved=0; double total_ms=0; uint64_t total_nodes=0;
+    double *times = malloc(sizeof(double)*(job.count ? job.count : 1));
+    for (size_t i=0;i<job.count;i++){
+        if (!job.items[i].solved) continue;
+        if (times) times[solved] = job.items[i].solve_ms;
+        solved++; total_ms += job.items[i].solve_ms; total_nodes += job.items[i].solve_nodes;
+    }
+    printf("solved %zu/%zu (%.1f%%)", solved, job.count, job.count ? 100.0*solved/job.count : 0.0);
+    if (solved){
+        if (times) qsort(times, solved, sizeof(double), cmp_double);
+        printf("  time to solution: total %.3fs, mean %.1f ms, median %.1f ms; mean nodes %llu",
+               total_ms/1000.0, total_ms/solved, times ? times[solved/2] : 0.0, (unsigned long long)(total_nodes/solved));
+    }
+    printf("\n");
+    free(times);
+    batch_free(&job);
+    return 0;
+}
+
+// Query service (--serve, --jsonl): request lines from any number of
+// connections go through a bounded ring to a fixed set of workers, each keeping
+// its own hash table warm across requests. A protocol parses a line into a
+// Query and formats the result; the transport delivers the reply as soon as it
+// is ready, or in request order when a delivery window is set.
+// Requests are copied into ring slots and replies are formatted into a buffer
+// on the worker's stack. Only --serve's per-connection output buffers allocate,
+// and only while they grow towards their bound.
+#define QUERY_LINE 4096
+#define QUERY_SLOTS 256
+#define QUERY_ID 64
+#define QUERY_MAX_PERFT 8
+
+enum { QUERY_SEARCH, QUERY_EVAL, QUERY_LEGAL, QUERY_PERFT };
+static const char *const query_ops[] = {"search", "eval", "legal", "perft"};
+
+typedef struct {
+    char id[QUERY_ID];
+    uint64_t seq;               // position among the submitted lines
+    int op;
+    Position pos;
+    SearchLimits limits;        // max_depth is also the perft depth
+    const char *error;          // set by the parser; replied instead of a result
+} Query;
+
+typedef struct {
+    SearchResult search;        // QUERY_SEARCH
+    int score;                  // QUERY_EVAL
+    MoveList legal;             // QUERY_LEGAL
+    uint64_t nodes;             // QUERY_PERFT
+    double ms;
+} QueryResult;
+
+// One reply destination; freed when the reader and every queued line are done with it
+typedef struct {
+    int fd;
+    pthread_mutex_t write_lock;
+    atomic_int refs;
+    char *out;                  // --serve: replies the I/O thread has not sent yet
+    size_t out_len, out_cap;
+    atomic_bool dead;           // --serve: dropped, or over its output bound; replies are discarded
+} QueryConn;
+
+typedef struct {
+    char line[QUERY_LINE];
+    QueryConn *conn;
+    uint64_t seq;
+} QuerySlot;
+
+typedef struct QueryService QueryService;
+struct QueryService {
+    QuerySlot slots[QUERY_SLOTS];
+    uint64_t head, tail;        // head: next slot to fill, tail: next to take
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    bool closing;               // no more submissions; workers drain and exit
+    volatile bool abort;        // stop running searches and drop queued lines
+    const volatile sig_atomic_t *interrupted;   // optional: submissions give up once set
+    uint64_t window;            // ordered delivery: max lines between delivered and head, 0 = off
+    uint64_t delivered;         // replies out in order so far (ordered delivery)
+    const CliOptions *opt;
+    void (*parse)(char *line, const CliOptions *opt, Query *q);
+    size_t (*format)(const Query *q, const QueryResult *r, char *out, size_t cap);
+    void (*deliver)(QueryService *svc, QueryConn *conn, uint64_t seq, const char *text, size_t len);
+};
+
+static void query_service_init(QueryService *svc, const CliOptions *opt){
+    memset(svc, 0, sizeof(*svc));
+    pthread_mutex_init(&svc->lock, NULL);
+    pthread_cond_init(&svc->not_empty, NULL);
+    pthread_cond_init(&svc->not_full, NULL);
+    svc->opt = opt;
+}
+
+static void query_service_destroy(QueryService *svc){
+    pthread_mutex_destroy(&svc->lock);
+    pthread_cond_destroy(&svc->not_empty);
+    pthread_cond_destroy(&svc->not_full);
+}
+
+static QueryConn *query_conn_new(int fd){
+    QueryConn *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->fd = fd;
+    pthread_mutex_init(&c->write_lock, NULL);
+    atomic_init(&c->refs, 1);
+    atomic_init(&c->dead, false);
+    return c;
+}
+
+static void query_conn_release(QueryConn *c){
+    if (atomic_fetch_sub(&c->refs, 1)!=1) return;
+    close(c->fd);
+    pthread_mutex_destroy(&c->write_lock);
+    free(c->out);
+    free(c);
+}
+
+// Writes the whole buffer; a peer that went away just loses its replies
+static void query_write(QueryConn *c, const char *text, size_t len){
+    pthread_mutex_lock(&c->write_lock);
+    for (size_t off=0; off<len; ){
+        ssize_t n = write(c->fd, text+off, len-off);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) break;
+        off += (size_t)n;
+    }
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+// Blocks while the ring (or the ordered delivery window) is full, which
+// throttles the reader; false if interrupted meanwhile. An empty line stands
+// for one that was too long.
+static bool query_submit(QueryService *svc, QueryConn *conn, const char *line, size_t len){
+    if (len>=QUERY_LINE) len = QUERY_LINE-1;
+    pthread_mutex_lock(&svc->lock);
+    while (svc->head-svc->tail==QUERY_SLOTS || (svc->window && svc->head-svc->delivered>=svc->window)){
+        if (!svc->interrupted){ pthread_cond_wait(&svc->not_full, &svc->lock); continue; }
+        if (*svc->interrupted){ pthread_mutex_unlock(&svc->lock); return false; }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000L;
+        if (ts.tv_nsec>=1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&svc->not_full, &svc->lock, &ts);
+    }
+    QuerySlot *s = &svc->slots[svc->head % QUERY_SLOTS];
+    memcpy(s->line, line, len);
+    s->line[len] = 0;
+    s->conn = conn;
+    s->seq = svc->head++;
+    atomic_fetch_add(&conn->refs, 1);
+    pthread_cond_signal(&svc->not_empty);
+    pthread_mutex_unlock(&svc->lock);
+    return true;
+}
+
+// Ordered delivery: everything before seq is out
+static void query_delivered(QueryService *svc, uint64_t seq){
+    pthread_mutex_lock(&svc->lock);
+    svc->delivered = seq;
+    pthread_cond_signal(&svc->not_full);
+    pthread_mutex_unlock(&svc->lock);
+}
+
+static void query_close(QueryService *svc){
+    pthread_mutex_lock(&svc->lock);
+    svc->closing = true;
+    pthread_cond_broadcast(&svc->not_empty);
+    pthread_mutex_unlock(&svc->lock);
+}
+
+static void query_execute(QueryService *svc, Query *q, HashTable *tt, QueryResult *r){
+    double t0 = wall_seconds();
+    switch (q->op){
+    case QUERY_SEARCH: { SearchLimits limits=q->limits; limits.hash=tt; limits.stop=&svc->abort; r->search = ffp_search(&q->pos, &limits); break; }
+    case QUERY_EVAL:   r->score = ffp_evaluate(&q->pos); break;
+    case QUERY_LEGAL:  ffp_generate_legal(&q->pos, &r->legal); break;
+    case QUERY_PERFT:  r->nodes = ffp_perft(&q->pos, q->limits.max_depth); break;
+    }
+    r->ms = (wall_seconds()-t0)*1000.0;
+}
+
+static void query_worker(int worker, void *arg){
+    (void)worker;
+    QueryService *svc=(QueryService*)arg;
+    HashTable tt;
+    bool has_tt = cli_hash(&tt, svc->opt);
+    char line[QUERY_LINE], out[QUERY_LINE];
+    Query q;
+    QueryResult r;
+    for (;;){
+        pthread_mutex_lock(&svc->lock);
+        while (svc->head==svc->tail && !svc->closing) pthread_cond_wait(&svc->not_empty, &svc->lock);
+        if (svc->head==svc->tail){ pthread_mutex_unlock(&svc->lock); break; }
+        QuerySlot *s = &svc->slots[svc->tail++ % QUERY_SLOTS];
+        memcpy(line, s->line, strlen(s->line)+1);
+        QueryConn *conn = s->conn;
+        uint64_t seq = s->seq;
+        pthread_cond_signal(&svc->not_full);
+        pthread_mutex_unlock(&svc->lock);
+        if (svc->abort || atomic_load_explicit(&conn->dead, memory_order_relaxed)){ query_conn_release(conn); continue; }
+
+        uint64_t tr = trace_now();
+        q.seq = seq;
+        svc->parse(line, svc->opt, &q);
+        if (!q.error) query_execute(svc, &q, has_tt ? &tt : NULL, &r);
+        svc->deliver(svc, conn, seq, out, svc->format(&q, &r, out, sizeof(out)));
+        TRACE_SPAN("query", tr, "seq", (int64_t)seq);
+        query_conn_release(conn);
+    }
+    if (has_tt) ffp_hash_free(&tt);
+}
+
+// snprintf that appends at *n and never runs past cap
+static void query_put(char *out, size_t cap, size_t *n, const char *fmt, ...){
+    if (*n>=cap) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int k = vsnprintf(out+*n, cap-*n, fmt, ap);
+    va_end(ap);
+    if (k>0) *n = *n+(size_t)k<cap ? *n+(size_t)k : cap-1;
+}
+
+// Line protocol: "<id> <op> [depth N] [nodes N] [movetime MS] [startpos | fen <FEN>] [moves m1 m2 ...]"
+static char *query_token(char **p){
+    while (**p==' ' || **p=='\t') (*p)++;
+    if (!**p) return NULL;
+    char *t = *p;
+    while (**p && **p!=' ' && **p!='\t') (*p)++;
+    if (**p) *(*p)++ = 0;
+    return t;
+}
+
+static bool query_keyword(const char *t){
+    static const char *const kw[] = {"depth", "nodes", "movetime", "startpos", "fen", "moves"};
+    for (size_t i=0;i<sizeof(kw)/sizeof(kw[0]);i++) if (!strcmp(t, kw[i])) return true;
+    return false;
+}
+
+static void query_reset(Query *q, const CliOptions *opt){
+    q->error = NULL;
+    q->id[0] = 0;
+    ffp_position_set_start(&q->pos);
+    q->limits = cli_limits(opt);
+}
+
+// Defaults for limits the request left out
+static void query_finish(Query *q, bool depth, bool bounded){
+    if (q->op==QUERY_PERFT){
+        if (!depth) q->limits.max_depth = 1;
+        if (q->limits.max_depth<0 || q->limits.max_depth>QUERY_MAX_PERFT) q->error = "perft depth out of range";
+    } else if (bounded && !depth) q->limits.max_depth = FFP_MAX_PLY-1;
+}
+
+static void query_parse_line(char *line, const CliOptions *opt, Query *q){
+    char *p=line, *t;
+    query_reset(q, opt);
+    if (!(t=query_token(&p))){ snprintf(q->id, sizeof(q->id), "-"); q->error = "line too long"; return; }
+    snprintf(q->id, sizeof(q->id), "%s", t);
+    if (!(t=query_token(&p))){ q->error = "missing op"; return; }
+    for (q->op=0; q->op<4 && strcmp(t, query_ops[q->op]); q->op++) {}
+    if (q->op==4){ q->error = "unknown op"; return; }
+    bool depth=false, bounded=false;
+    t = query_token(&p);
+    while (t){
+        if (!strcmp(t,"depth") || !strcmp(t,"nodes") || !strcmp(t,"movetime")){
+            char *v = query_token(&p);
+            if (!v || !isdigit((unsigned char)*v)){ q->error = "bad limit"; return; }
+            if (*t=='d'){ q->limits.max_depth = atoi(v); depth=true; }
+            else if (*t=='n'){ q->limits.node_limit = strtoull(v, NULL, 10); bounded=true; }
+            else { q->limits.time_ms = atoi(v); bounded=true; }
+            t = query_token(&p);
+        } else if (!strcmp(t,"startpos")){
+            ffp_position_set_start(&q->pos);
+            t = query_token(&p);
+        } else if (!strcmp(t,"fen")){
+            // Up to six fields, rejoined in place over the separators
+            char *fen = query_token(&p);
+            int fields = fen ? 1 : 0;
+            while ((t=query_token(&p)) && fields<6 && !query_keyword(t)){
+                for (char *s=fen; s<t; s++) if (!*s) *s=' ';
+                fields++;
+            }
+            if (!fen || !ffp_position_from_fen(&q->pos, fen)){ q->error = "bad fen"; return; }
+        } else if (!strcmp(t,"moves")){
+            while ((t=query_token(&p)) && !query_keyword(t)){
+                Move m; Undo u;
+                if (!ffp_move_from_string(&q->pos, t, &m)){ q->error = "illegal move"; return; }
+                ffp_make_move(&q->pos, m, &u);
+            }
+        } else { q->error = "unknown keyword"; return; }
+    }
+    query_finish(q, depth, bounded);
+}
+
+static size_t query_format_line(const Query *q, const QueryResult *r, char *out, size_t cap){
+    size_t n=0;
+    char mv[6];
+    query_put(out, cap, &n, "%s ", q->id);
+    if (q->error) query_put(out, cap, &n, "error %s", q->error);
+    else switch (q->op){
+    case QUERY_SEARCH:
+        ffp_move_to_string(&r->search.best_move, mv);
+        if (!mv[0]) strcpy(mv, "0000");    // no legal move
+        query_put(out, cap, &n, "bestmove %s score %d depth %d nodes %llu time %.1f pv", mv, r->search.score,
+                  r->search.depth_reached, (unsigned long long)r->search.nodes, r->ms);
+        for (int i=0;i<r->search.pv_length;i++){ ffp_move_to_string(&r->search.pv[i], mv); query_put(out, cap, &n, " %s", mv); }
+        break;
+    case QUERY_EVAL:
+        query_put(out, cap, &n, "score %d", r->score);
+        break;
+    case QUERY_LEGAL:
+        query_put(out, cap, &n, "moves %d", r->legal.count);
+        for (int i=0;i<r->legal.count;i++){ ffp_move_to_string(&r->legal.list[i], mv); query_put(out, cap, &n, " %s", mv); }
+        break;
+    case QUERY_PERFT:
+        query_put(out, cap, &n, "nodes %llu time %.1f", (unsigned long long)r->nodes, r->ms);
+        break;
+    }
+    if (n>=cap-1) n = cap-2;
+    out[n++] = '\n';
+    out[n] = 0;
+    return n;
+}
+
+// Splits one input stream into request lines; replies go to conn
+typedef struct {
+    int fd;
+    QueryConn *conn;
+    size_t used;
+    bool overflow;              // discarding the rest of an over-long line
+    bool eof;                   // --serve: input finished, replies may still be pending
+    double stalled;             // --serve: since when replies wait on a full socket, 0 = draining
+    char buf[QUERY_LINE];
+} QueryReader;
+
+// Queues every complete line, and at end of input an unterminated last one;
+// false at end of input or when a submission was interrupted
+static bool query_read(QueryService *svc, QueryReader *r){
+    ssize_t k = read(r->fd, r->buf+r->used, sizeof(r->buf)-r->used);
+    if (k<0 && (errno==EINTR || errno==EAGAIN)) return true;
+    if (k==0 && r->used && !r->overflow) query_submit(svc, r->conn, r->buf, r->used);
+    if (k<=0) return false;
+    size_t end = r->used+(size_t)k, start=0;
+    for (size_t i=r->used; i<end; i++){
+        if (r->buf[i]!='\n') continue;
+        size_t len = i-start;
+        if (len && r->buf[start+len-1]=='\r') len--;
+        if (r->overflow) r->overflow = false;
+        else if (len && !query_submit(svc, r->conn, r->buf+start, len)) return false;
+        start = i+1;
+    }
+    r->used = end-start;
+    memmove(r->buf, r->buf+start, r->used);
+    if (r->used==sizeof(r->buf)){
+        if (!r->overflow && !query_submit(svc, r->conn, "", 0)) return false;
+        r->overflow = true;
+        r->used = 0;
+    }
+    return true;
+}
+
+// --serve: one I/O thread polls the listening socket and every client, splits
+// the input into lines and queues them. Workers never touch the sockets: they
+// append replies to the connection's output buffer and poke the I/O thread,
+// which sends what each (non-blocking) socket accepts. Past SERVE_OUT_HIGH
+// unsent bytes a client's requests are left unread until it catches up, so the
+// buffer stays below that plus one reply per ring slot; a client that takes
+// nothing for SERVE_STALL_SEC while replies wait is dropped.
+#define SERVE_MAX_CLIENTS 1024
+#define SERVE_OUT_HIGH ((size_t)4<<20)
+#define SERVE_STALL_SEC 30.0
+
+typedef struct {
+    QueryService *svc;
+    int listen_fd;
+    int wake;                   // read end of serve_wake's pipe
+    atomic_bool workers_done;   // every reply is in an output buffer
+} ServeJob;
+
+static volatile sig_atomic_t serve_stop;
+static int serve_wake = -1;     // written after each reply
+
+static void serve_signal(int sig){ (void)sig; serve_stop = 1; }
+
+static void serve_poke(void){
+    char b = 1;
+    ssize_t w = write(serve_wake, &b, 1);   // a full pipe already means "wake up"
+    (void)w;
+}
+
+static void serve_deliver(QueryService *svc, QueryConn *c, uint64_t seq, const char *text, size_t len){
+    (void)svc; (void)seq;
+    pthread_mutex_lock(&c->write_lock);
+    if (!atomic_load(&c->dead) && c->out_len+len > c->out_cap){
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len+len) cap *= 2;
+        char *b = realloc(c->out, cap);
+        if (b){ c->out = b; c->out_cap = cap; }
+        else atomic_store(&c->dead, true);
+    }
+    if (!atomic_load(&c->dead)){ memcpy(c->out+c->out_len, text, len); c->out_len += len; }
+    pthread_mutex_unlock(&c->write_lock);
+    serve_poke();
+}
+
+// Sends what the socket takes without blocking; false when the client is gone
+static bool serve_flush(QueryConn *c){
+    bool ok = !atomic_load(&c->dead);
+    size_t off = 0;
+    pthread_mutex_lock(&c->write_lock);
+    while (ok && off<c->out_len){
+        ssize_t n = send(c->fd, c->out+off, c->out_len-off, MSG_NOSIGNAL);
+        if (n>0) off += (size_t)n;
+        else if (n<0 && errno==EINTR) continue;
+        else { ok = n<0 && (errno==EAGAIN || errno==EWOULDBLOCK); break; }
+    }
+    memmove(c->out, c->out+off, c->out_len-off);
+    c->out_len -= off;
+    pthread_mutex_unlock(&c->write_lock);
+    return ok;
+}
+
+static size_t serve_pending(QueryConn *c){
+    pthread_mutex_lock(&c->write_lock);
+    size_t n = c->out_len;
+    pthread_mutex_unlock(&c->write_lock);
+    return n;
+}
+
+static void serve_drop(QueryReader *c){
+    atomic_store(&c->conn->dead, true);
+    query_conn_release(c->conn);
+    free(c);
+}
+
+// On SIGINT/SIGTERM: stop accepting and reading, abort running searches, drop
+// queued lines, then keep flushing until the workers are done and the buffers
+// are empty (or a second has passed)
+static void *serve_io(void *arg){
+    ServeJob *job=(ServeJob*)arg;
+    QueryService *svc = job->svc;
+    static struct pollfd pfd[SERVE_MAX_CLIENTS+2];
+    static QueryReader *clients[SERVE_MAX_CLIENTS];
+    int n=0;
+    bool stopping=false;
+    double deadline=0;
+    for (;;){
+        double now = wall_seconds();
+        if (serve_stop && !stopping){ stopping = true; svc->abort = true; query_close(svc); }
+        if (stopping && atomic_load(&job->workers_done)){
+            if (!deadline) deadline = now+1.0;
+            bool pending=false;
+            for (int i=0;i<n && !pending;i++) pending = serve_pending(clients[i]->conn)>0;
+            if (!pending || now>deadline) break;
+        }
+        pfd[0] = (struct pollfd){ .fd=job->wake, .events=POLLIN };
+        pfd[1] = (struct pollfd){ .fd=stopping ? -1 : job->listen_fd, .events=POLLIN };
+        for (int i=0;i<n;i++){
+            size_t pending = serve_pending(clients[i]->conn);
+            short ev = !clients[i]->eof && !stopping && pending<=SERVE_OUT_HIGH ? POLLIN : 0;
+            if (pending) ev |= POLLOUT;
+            pfd[i+2] = (struct pollfd){ .fd=clients[i]->fd, .events=ev };
+        }
+        int ready = poll(pfd, (nfds_t)n+2, 200);
+        if (ready>0 && pfd[0].revents){ char buf[256]; while (read(job->wake, buf, sizeof(buf))>0) {} }
+        for (int i=n-1;i>=0;i--){
+            QueryReader *c = clients[i];
+            short re = ready>0 ? pfd[i+2].revents : 0;
+            bool keep = !atomic_load(&c->conn->dead);
+            if (keep && (re & POLLIN) && !query_read(svc, c)) c->eof = true;
+            if (keep && (re & (POLLERR|POLLHUP|POLLNVAL)) && !(re & POLLIN)) keep = false;
+            if (keep && (re & POLLOUT)) keep = serve_flush(c->conn);
+            size_t pending = keep ? serve_pending(c->conn) : 0;
+            if (!pending || (re & POLLOUT)) c->stalled = 0;
+            else if (!c->stalled) c->stalled = now;
+            else if (now-c->stalled > SERVE_STALL_SEC) keep = false;
+            if (keep && c->eof && atomic_load(&c->conn->refs)==1 && !pending) keep = false;
+            if (!keep){ serve_drop(c); clients[i] = clients[--n]; }
+        }
+        if (ready>0 && (pfd[1].revents & POLLIN)){
+            int fd = accept(job->listen_fd, NULL, NULL);
+            QueryReader *c = fd>=0 && n<SERVE_MAX_CLIENTS && fcntl(fd, F_SETFL, O_NONBLOCK)==0 ? calloc(1, sizeof(*c)) : NULL;
+            if (c && (c->conn = query_conn_new(fd))){ c->fd = fd; clients[n++] = c; }
+            else if (fd>=0){ free(c); close(fd); }
+        }
+    }
+    for (int i=0;i<n;i++) serve_drop(clients[i]);
+    return NULL;
+}
+
+// Binds path, replacing a stale socket file but never a live server or another file
+static int serve_listen(const char *path){
+    struct sockaddr_un addr = { .sun_family=AF_UNIX };
+    if (strlen(path)>=sizeof(addr.sun_path)){ fprintf(stderr, "socket path too long: %s\n", path); return -1; }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st)==0){
+        if (!S_ISSOCK(st.st_mode)){ fprintf(stderr, "%s exists and is not a socket\n", path); return -1; }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe>=0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr))==0;
+        if (probe>=0) close(probe);
+        if (live){ fprintf(stderr, "a server is already listening on %s\n", path); return -1; }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd<0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr))!=0 || listen(fd, 64)!=0){
+        fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+        if (fd>=0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int cmd_serve(const char *path, const CliOptions *cli){
+    CliOptions opt_ = *cli, *opt = &opt_;
+    if (opt->hash_mb<=0) opt->hash_mb = 16;
+    QueryService *svc = malloc(sizeof(*svc));
+    if (!svc) return 1;
+    int fd = serve_listen(path), wake[2];
+    if (fd<0){ free(svc); return 1; }
+    if (pipe(wake)!=0){ close(fd); unlink(path); free(svc); return 1; }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    serve_wake = wake[1];
+    query_service_init(svc, opt);
+    svc->parse = query_parse_line;
+    svc->format = query_format_line;
+    svc->deliver = serve_deliver;
+    svc->interrupted = &serve_stop;
+    struct sigaction sa = { .sa_handler=serve_signal }, ign = { .sa_handler=SIG_IGN };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGPIPE, &ign, NULL);
+    ServeJob job = { .svc=svc, .listen_fd=fd, .wake=wake[0] };
+    atomic_init(&job.workers_done, false);
+    pthread_t io;
+    if (pthread_create(&io, NULL, serve_io, &job)!=0){ close(fd); close(wake[0]); close(wake[1]); unlink(path); free(svc); return 1; }
+    fprintf(stderr, "serving on %s with %d workers, %d MB hash each\n", path, opt->threads, opt->hash_mb);
+    run_workers(opt->threads, query_worker, svc);
+    atomic_store(&job.workers_done, true);
+    serve_poke();
+    pthread_join(io, NULL);
+    close(wake[0]);
+    close(wake[1]);
+    serve_wake = -1;
+    close(fd);
+    unlink(path);
+    query_service_destroy(svc);
+    free(svc);
+    fprintf(stderr, "server stopped\n");
+    return 0;
+}
+
+// --jsonl: one flat JSON object per line, e.g.
+// {"id":7,"op":"search","fen":"...","moves":"e2e4 e7e5","depth":8,"nodes":100000,"movetime":500}
+// Strings are decoded in place and the id is echoed back verbatim.
+#define QUERY_MOVES 1024
+
+static char *json_ws(char *p){ while (*p==' ' || *p=='\t') p++; return p; }
+
+// Decodes the string whose opening quote is at p in place; returns the end, or NULL
+static char *json_string(char *p, char **out){
+    char *w = *out = ++p;
+    for (;;){
+        char c = *p++;
+        if (!c) return NULL;
+        if (c=='"'){ *w = 0; return p; }
+        if (c=='\\'){
+            switch (c = *p++){
+            case '"': case '\\': case '/': break;
+            case 'n': c='\n'; break;
+            case 't': c='\t'; break;
+            case 'r': c='\r'; break;
+            default: return NULL;
+            }
+        }
+        *w++ = c;
+    }
+}
+
+// Skips any value, nested or not; returns the end, or NULL
+static char *json_skip(char *p){
+    int depth=0;
+    do {
+        p = json_ws(p);
+        if (*p=='"'){
+            for (p++; *p!='"'; p++){ if (!*p || (*p=='\\' && !*++p)) return NULL; }
+            p++;
+        } else if (*p=='{' || *p=='['){ depth++; p++; continue; }
+        else if (*p=='}' || *p==']'){ if (--depth<0) return NULL; p++; }
+        else if (*p==',' || *p==':'){ if (!depth) return NULL; p++; continue; }
+        else {
+            char *v=p;
+            while (*p && !strchr(",:]} \t", *p)) p++;
+            if (p==v) return NULL;
+        }
+    } while (depth);
+    return p;
+}
+
+// A string, number, true, false or null; returns the end, or NULL
+static char *json_scalar(char *p){
+    if (*p=='"'){
+        char *end = json_skip(p);
+        for (char *c=p; end && c<end; c++) if ((unsigned char)*c<0x20) return NULL;
+        return end;
+    }
+    static const char *const words[] = {"true", "false", "null"};
+    for (int i=0;i<3;i++) if (!strncmp(p, words[i], strlen(words[i]))) return p+strlen(words[i]);
+    char *q = p + (*p=='-');
+    if (!isdigit((unsigned char)*q)) return NULL;
+    if (*q=='0') q++;
+    else while (isdigit((unsigned char)*q)) q++;
+    if (*q=='.'){ if (!isdigit((unsigned char)*++q)) return NULL; while (isdigit((unsigned char)*q)) q++; }
+    if (*q=='e' || *q=='E'){
+        q += q[1]=='+' || q[1]=='-' ? 2 : 1;
+        if (!isdigit((unsigned char)*q)) return NULL;
+        while (isdigit((unsigned char)*q)) q++;
+    }
+    return q;
+}
+
+static void query_parse_json(char *line, const CliOptions *opt, Query *q){
+    char *p = json_ws(line), *fen=NULL, *moves[QUERY_MOVES];
+    int nmoves=0;
+    bool depth=false, bounded=false;
+    query_reset(q, opt);
+    q->op = -1;
+    if (!*p){ q->error = "line too long"; return; }
+    if (*p++!='{'){ q->error = "expected an object"; return; }
+    for (p=json_ws(p); *p!='}'; p=json_ws(p)){
+        char *key, *v;
+        if (*p!='"' || !(p=json_string(p, &key)) || *(p=json_ws(p))!=':'){ q->error = "bad key"; return; }
+        p = json_ws(p+1);
+        if (!strcmp(key,"id")){
+            if (!(v=json_scalar(p)) || v-p>=QUERY_ID || !strchr(",} \t", *v)){ q->error = "bad id"; return; }
+            memcpy(q->id, p, (size_t)(v-p));
+            q->id[v-p] = 0;
+            p = v;
+        } else if (!strcmp(key,"op") || !strcmp(key,"fen")){
+            if (*p!='"' || !(p=json_string(p, &v))){ q->error = "bad string"; return; }
+            if (*key=='f') fen = v;
+            else for (q->op=0; q->op<4 && strcmp(v, query_ops[q->op]); q->op++) {}
+        } else if (!strcmp(key,"moves")){
+            // "e2e4 e7e5" or ["e2e4","e7e5"]
+            if (*p=='"'){
+                if (!(p=json_string(p, &v))){ q->error = "bad moves"; return; }
+                for (char *t; (t=query_token(&v)); ) if (nmoves<QUERY_MOVES) moves[nmoves++] = t;
+            } else if (*p=='['){
+                for (p=json_ws(p+1); *p!=']'; ){
+                    if (*p!='"' || !(p=json_string(p, &v))){ q->error = "bad moves"; return; }
+                    if (nmoves<QUERY_MOVES) moves[nmoves++] = v;
+                    p = json_ws(p);
+                    if (*p==',') p = json_ws(p+1);
+                    else if (*p!=']'){ q->error = "bad moves"; return; }
+                }
+                p++;
+            } else { q->error = "bad moves"; return; }
+        } else if (!strcmp(key,"depth") || !strcmp(key,"nodes") || !strcmp(key,"movetime")){
+            if (!isdigit((unsigned char)*p)){ q->error = "bad limit"; return; }
+            uint64_t n = strtoull(p, &p, 10);
+            if (*key=='d'){ q->limits.max_depth = n>FFP_MAX_PLY ? FFP_MAX_PLY : (int)n; depth=true; }
+            else if (*key=='n'){ q->limits.node_limit = n; bounded=true; }
+            else { q->limits.time_ms = n>INT32_MAX ? INT32_MAX : (int)n; bounded=true; }
+        } else if (!(p=json_skip(p))){ q->error = "bad value"; return; }
+        p = json_ws(p);
+        if (*p==',') p++;
+        else if (*p!='}'){ q->error = "expected , or }"; return; }
+    }
+    if (q->op<0 || q->op==4){ q->error = q->op<0 ? "missing op" : "unknown op"; return; }
+    if (fen && !ffp_position_from_fen(&q->pos, fen)){ q->error = "bad fen"; return; }
+    for (int i=0;i<nmoves;i++){
+        Move m; Undo u;
+        if (!ffp_move_from_string(&q->pos, moves[i], &m)){ q->error = "illegal move"; return; }
+        ffp_make_move(&q->pos, m, &u);
+    }
+    query_finish(q, depth, bounded);
+}
+
+static size_t query_format_json(const Query *q, const QueryResult *r, char *out, size_t cap){
+    size_t n=0;
+    char mv[6];
+    query_put(out, cap, &n, "{\"index\":%llu", (unsigned long long)q->seq);
+    if (q->id[0]) query_put(out, cap, &n, ",\"id\":%s", q->id);
+    if (q->error) query_put(out, cap, &n, ",\"error\":\"%s\"", q->error);
+    else switch (q->op){
+    case QUERY_SEARCH:
+        ffp_move_to_string(&r->search.best_move, mv);
+        if (!mv[0]) strcpy(mv, "0000");    // no legal move
+        query_put(out, cap, &n, ",\"bestmove\":\"%s\",\"score\":%d,\"depth\":%d,\"nodes\":%llu,\"time_ms\":%.1f,\"pv\":\"", mv,
+                  r->search.score, r->search.depth_reached, (unsigned long long)r->search.nodes, r->ms);
+        for (int i=0;i<r->search.pv_length;i++){ ffp_move_to_string(&r->search.pv[i], mv); query_put(out, cap, &n, i ? " %s" : "%s", mv); }
+        query_put(out, cap, &n, "\"");
+        break;
+    case QUERY_EVAL:
+        query_put(out, cap, &n, ",\"score\":%d", r->score);
+        break;
+    case QUERY_LEGAL:
+        query_put(out, cap, &n, ",\"count\":%d,\"moves\":\"", r->legal.count);
+        for (int i=0;i<r->legal.count;i++){ ffp_move_to_string(&r->legal.list[i], mv); query_put(out, cap, &n, i ? " %s" : "%s", mv); }
+        query_put(out, cap, &n, "\"");
+        break;
+    case QUERY_PERFT:
+        query_put(out, cap, &n, ",\"nodes\":%llu,\"time_ms\":%.1f", (unsigned long long)r->nodes, r->ms);
+        break;
+    }
+    query_put(out, cap, &n, "}");
+    if (n>=cap-1) n = cap-2;
+    out[n++] = '\n';
+    out[n] = 0;
+    return n;
+}
+
+// --ordered keeps up to QUERY_SLOTS finished replies until the earlier ones are out
+typedef struct {
+    QueryService svc;
+    QueryReader reader;
+    pthread_mutex_t lock;
+    uint64_t next;              // next seq to print
+    size_t len[QUERY_SLOTS];    // 0 = not finished yet
+    char text[QUERY_SLOTS][QUERY_LINE];
+} JsonlJob;
+
+static void jsonl_deliver(QueryService *svc, QueryConn *conn, uint64_t seq, const char *text, size_t len){
+    if (!svc->window){ query_write(conn, text, len); return; }
+    JsonlJob *job = (JsonlJob*)svc;
+    pthread_mutex_lock(&job->lock);
+    memcpy(job->text[seq % QUERY_SLOTS], text, len);
+    job->len[seq % QUERY_SLOTS] = len;
+    uint64_t first = job->next;
+    for (size_t *l; *(l=&job->len[job->next % QUERY_SLOTS]); job->next++){
+        query_write(conn, job->text[job->next % QUERY_SLOTS], *l);
+        *l = 0;
+    }
+    uint64_t next = job->next;
+    pthread_mutex_unlock(&job->lock);
+    if (next!=first) query_delivered(svc, next);
+}
+
+static void *jsonl_read(void *arg){
+    JsonlJob *job=(JsonlJob*)arg;
+    QueryReader *r = &job->reader;
+    while (query_read(&job->svc, r)) {}
+    query_conn_release(r->conn);
+    query_close(&job->svc);
+    return NULL;
+}
+
+static int cmd_jsonl(const CliOptions *cli){
+    CliOptions opt_ = *cli, *opt = &opt_;
+    if (opt->hash_mb<=0) opt->hash_mb = 16;
+    JsonlJob *job = calloc(1, sizeof(*job));
+    QueryConn *out = query_conn_new(STDOUT_FILENO);
+    if (!job || !out){ free(job); free(out); return 1; }
+    QueryService *svc = &job->svc;
+    query_service_init(svc, opt);
+    svc->parse = query_parse_json;
+    svc->format = query_format_json;
+    svc->deliver = jsonl_deliver;
+    svc->window = opt->ordered ? QUERY_SLOTS : 0;
+    pthread_mutex_init(&job->lock, NULL);
+    job->reader.fd = STDIN_FILENO;
+    job->reader.conn = out;
+    double t0 = wall_seconds();
+    pthread_t io;
+    if (pthread_create(&io, NULL, jsonl_read, job)!=0){ query_conn_release(out); free(job); return 1; }
+    run_workers(opt->threads, query_worker, svc);
+    pthread_join(io, NULL);
+    fprintf(stderr, "answered %llu requests in %.3fs\n", (unsigned long long)svc->head, wall_seconds()-t0);
+    query_service_destroy(svc);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    return 0;
+}
+
+// Self-play data generation. Every worker plays whole games with its own hash
+// table and fills a private chunk; full chunks are pushed onto a lock-free
+// stack that a single writer thread drains to the packed output file.
+#define DATAGEN_CHUNK 4096
+#define DATAGEN_MAX_PLIES 400
+#define DATAGEN_WIN_SCORE 1000     // adjudicate a win after WIN_PLIES plies beyond this
+#define DATAGEN_WIN_PLIES 6
+#define DATAGEN_DRAW_SCORE 10      // adjudicate a draw after DRAW_PLIES plies within this
+#define DATAGEN_DRAW_PLIES 12
+#define DATAGEN_DRAW_AFTER 80
+
+typedef struct DatagenChunk {
+    struct DatagenChunk *next;
+    size_t count;
+    PackedPosition recs[DATAGEN_CHUNK];
+} DatagenChunk;
+
+typedef struct {
+    const CliOptions *opt;
+    uint64_t seed;
+    atomic_uint_fast64_t next_game;
+    _Atomic(DatagenChunk*) full;         // Treiber stack: producers CAS-push, the writer takes all
+    atomic_bool done;
+    atomic_bool failed;                  // a worker could not allocate a chunk
+    atomic_uint_fast64_t games, positions, wins, draws, losses;
+    PackedWriter out;
+} DatagenJob;
+
+static void datagen_push(DatagenJob *job, DatagenChunk *c){
+    DatagenChunk *head = atomic_load_explicit(&job->full, memory_order_relaxed);
+    do c->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&job->full, &head, c, memory_order_release, memory_order_relaxed));
+}
+
+static void *datagen_writer(void *arg){
+    DatagenJob *job=(DatagenJob*)arg;
+    for (;;){
+        bool last = atomic_load_explicit(&job->done, memory_order_acquire);
+        DatagenChunk *c = atomic_exchange_explicit(&job->full, NULL, memory_order_acquire);
+        if (!c){
+            if (last) break;
+            struct timespec ts = {0, 2000000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        DatagenChunk *fifo=NULL;
+        while (c){ DatagenChunk *n=c->next; c->next=fifo; fifo=c; c=n; }
+        while (fifo){
+            DatagenChunk *n=fifo->next;
+            ffp_packed_writer_write(&job->out, fifo->recs, fifo->count);
+            free(fifo);
+            fifo=n;
+        }
+    }
+    return NULL;
+}
+
+static bool insufficient_material(const Position *pos){
+    if (pos->bb[WP]|pos->bb[BP]|pos->bb[WR]|pos->bb[BR]|pos->bb[WQ]|pos->bb[BQ]) return false;
+    return popcount64(pos->bb[WN]|pos->bb[BN]|pos->bb[WB]|pos->bb[BB]) <= 1;
+}
+
+static bool side_in_check(const Position *pos){
+    U64 k = pos->bb[pos->side==WHITE ? WK : BK];
+    return k && ffp_is_square_attacked(pos, LSB_INDEX(k), pos->side==WHITE ? BLACK : WHITE);
+}
+
+typedef struct { Position pos; PackedInfo info; } DatagenRecord;
+
+// Plays one game; positions are appended to rec (capacity DATAGEN_MAX_PLIES). Returns FFP_RESULT_*
+static int datagen_game(U64 *rng, int random_plies, const SearchLimits *limits, DatagenRecord *rec, size_t *count){
+    Position pos; set_from_fen(&pos, FFP_FEN_STARTPOS);
+    U64 keys[DATAGEN_MAX_PLIES+1];
+    Move moves[256];
+    for (int ply=0; ply<random_plies; ply++){
+        int n = ffp_generate_legal_array(&pos, moves, 256);
+        if (!n) return FFP_RESULT_NONE;
+        Undo u; ffp_make_move(&pos, moves[splitmix64(rng)%n], &u);
+    }
+    if (!has_legal_move(&pos)) return FFP_RESULT_NONE;
+    *count=0;
+    int win_plies=0, draw_plies=0, win_sign=0;
+    for (int ply=0;; ply++){
+        keys[ply]=pos.key;
+        if (!has_legal_move(&pos)) return side_in_check(&pos) ? (pos.side==WHITE ? FFP_RESULT_BLACK_WIN : FFP_RESULT_WHITE_WIN) : FFP_RESULT_DRAW;
+        if (pos.halfmove_clock>=100 || insufficient_material(&pos) || ply>=DATAGEN_MAX_PLIES) return FFP_RESULT_DRAW;
+        for (int back=2; back<=pos.halfmove_clock && back<=ply; back+=2)
+            if (keys[ply-back]==pos.key) return FFP_RESULT_DRAW;
+        SearchResult res = ffp_search(&pos, limits);
+        int white = pos.side==WHITE ? res.score : -res.score;
+        bool mate = res.score>=MATE_BOUND || res.score<=-MATE_BOUND;
+        if (!mate && !(res.best_move.flags & (MF_CAPTURE|MF_ENPASSANT|MF_PROMO)) && !side_in_check(&pos)){
+            PackedInfo info = { .score=(int16_t)white, .has_score=true, .move=ffp_move_pack(&res.best_move) };
+            rec[(*count)++] = (DatagenRecord){ pos, info };
+        }
+        int sign = white>=DATAGEN_WIN_SCORE ? 1 : white<=-DATAGEN_WIN_SCORE ? -1 : 0;
+        win_plies = sign && sign==win_sign ? win_plies+1 : sign ? 1 : 0;
+        win_sign = sign;
+        if (win_plies>=DATAGEN_WIN_PLIES) return sign>0 ? FFP_RESULT_WHITE_WIN : FFP_RESULT_BLACK_WIN;
+        draw_plies = (ply>=DATAGEN_DRAW_AFTER && white<=DATAGEN_DRAW_SCORE && white>=-DATAGEN_DRAW_SCORE) ? draw_plies+1 : 0;
+        if (draw_plies>=DATAGEN_DRAW_PLIES) return FFP_RESULT_DRAW;
+        Undo u; ffp_make_move(&pos, res.best_move, &u);
+    }
+}
+
+static void datagen_worker(int worker, void *arg){
+    (void)worker;
+    DatagenJob *job=(DatagenJob*)arg;
+    HashTable tt;
+    SearchLimits limits = cli_limits(job->opt);
+    if (ffp_hash_init(&tt, (size_t)(job->opt->hash_mb>0 ? job->opt->hash_mb : 8))) limits.hash=&tt;
+    DatagenRecord game[DATAGEN_MAX_PLIES+1];
+    DatagenChunk *chunk=NULL;
+    for (;;){
+        uint64_t g = atomic_fetch_add(&job->next_game, 1);
+        if (g>=job->opt->games || atomic_load_explicit(&job->failed, memory_order_relaxed)) break;
+        U64 rng = job->seed ^ (g * 0x9E3779B97F4A7C15ULL);   // games do not depend on the thread that plays them
+        if (limits.hash) ffp_hash_clear(limits.hash);
+        size_t n=0;
+        uint64_t tr = trace_now();
+        int result = datagen_game(&rng, job->opt->random_plies, &limits, game, &n);
+        TRACE_SPAN("game", tr, "game", (int64_t)g);
+        if (result==FFP_RESULT_NONE) continue;
+        atomic_fetch_add(result==FFP_RESULT_WHITE_WIN ? &job->wins : result==FFP_RESULT_DRAW ? &job->draws : &job->losses, 1);
+        atomic_fetch_add(&job->games, 1);
+        for (size_t i=0;i<n;i++){
+            if (!chunk){
+                if (!(chunk = malloc(sizeof(DatagenChunk)))){ atomic_store(&job->failed, true); break; }
+                chunk->count = 0;
+            }
+            game[i].info.result = (uint8_t)result;
+            if (!ffp_position_pack(&game[i].pos, &game[i].info, &chunk->recs[chunk->count])) continue;
+            atomic_fetch_add(&job->positions, 1);
+            if (++chunk->count==DATAGEN_CHUNK){ datagen_push(job, chunk); chunk=NULL; }
+        }
+    }
+    if (chunk && chunk->count) datagen_push(job, chunk);
+    else free(chunk);
+    if (limits.hash) ffp_hash_free(&tt);
+}
+
+static int cmd_datagen(const char *path, const CliOptions *opt){
+    CliOptions o = *opt;
+    if (!o.games) o.games=100;
+    if (o.random_plies<0) o.random_plies=8;
+    if (!o.nodes && !o.depth && !o.movetime) o.nodes=5000;
+    DatagenJob job;
+    memset(&job, 0, sizeof(job));
+    job.opt = &o;
+    job.seed = o.seed ? o.seed : (uint64_t)(wall_seconds()*1e9);
+    atomic_init(&job.full, NULL);
+    if (!ffp_packed_writer_open(&job.out, path)){ fprintf(stderr, "cannot write %s\n", path); return 1; }
+    fprintf(stderr, "datagen: %llu games, %d random plies, seed %llu\n",
+            (unsigned long long)o.games, o.random_plies, (unsigned long long)job.seed);
+    double t0 = wall_seconds();
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, datagen_writer, &job)){ ffp_packed_writer_close(&job.out); return 1; }
+    run_workers(o.threads, datagen_worker, &job);
+    atomic_store_explicit(&job.done, true, memory_order_release);
+    pthread_join(writer, NULL);
+    bool ok = ffp_packed_writer_close(&job.out);
+    double sec = wall_seconds()-t0;
+    uint64_t pos = atomic_load(&job.positions);
+    printf("datagen: %llu games (+%llu =%llu -%llu), %llu positions  (%.3fs, %.0f pos/s)\n",
+           (unsigned long long)atomic_load(&job.games), (unsigned long long)atomic_load(&job.wins),
+           (unsigned long long)atomic_load(&job.draws), (unsigned long long)atomic_load(&job.losses),
+           (unsigned long long)pos, sec, sec>0 ? pos/sec : 0);
+    if (atomic_load(&job.failed)){ fprintf(stderr, "datagen: out of memory, %s is incomplete\n", path); return 1; }
+    if (!ok){ fprintf(stderr, "writing %s failed\n", path); return 1; }
+    return 0;
+}
+
+// Texel tuning: the dataset is reduced once to the evaluation's feature counts
+// and a target in [0,1]; every epoch computes the sigmoid loss and its gradient
+// in parallel over contiguous slices and takes one Adam step.
+#define TUNE_MAX_THREADS 256
+
+typedef struct {
+    int8_t *features;           // count * FFP_EVAL_PARAMS
+    float *target;              // white's expected score
+    size_t count;
+    int threads;
+    double params[FFP_EVAL_PARAMS];
+    double k;                   // sigmoid scale, win probability = 1/(1+10^(-k*eval/400))
+    bool want_grad;
+    struct { double loss, grad[FFP_EVAL_PARAMS]; char pad[64]; } part[TUNE_MAX_THREADS];
+} TuneJob;
+
+static void tune_worker(int worker, void *arg){
+    TuneJob *job=(TuneJob*)arg;
+    size_t lo = job->count*worker/job->threads, hi = job->count*(worker+1)/job->threads;
+    double loss=0, grad[FFP_EVAL_PARAMS]={0};
+    const double scale = job->k*2.302585092994046/400.0; // ln(10)*k/400
+    for (size_t i=lo;i<hi;i++){
+        const int8_t *f = job->features + i*FFP_EVAL_PARAMS;
+        double e=0;
+        for (int j=0;j<FFP_EVAL_PARAMS;j++) e += job->params[j]*f[j];
+        double p = 1.0/(1.0+exp(-scale*e));
+        double d = p - job->target[i];
+        loss += d*d;
+        if (job->want_grad){
+            double g = d*p*(1.0-p);
+            for (int j=0;j<FFP_EVAL_PARAMS;j++) grad[j] += g*f[j];
+        }
+    }
+    job->part[worker].loss = loss;
+    for (int j=0;j<FFP_EVAL_PARAMS;j++) job->part[worker].grad[j] = grad[j]*2.0*scale;
+}
+
+static double tune_loss(TuneJob *job, double grad[FFP_EVAL_PARAMS]){
+    job->want_grad = grad!=NULL;
+    run_workers(job->threads, tune_worker, job);
+    double loss=0;
+    if (grad) memset(grad, 0, sizeof(double)*FFP_EVAL_PARAMS);
+    for (int t=0;t<job->threads;t++){
+        loss += job->part[t].loss;
+        if (grad) for (int j=0;j<FFP_EVAL_PARAMS;j++) grad[j] += job->part[t].grad[j]/job->count;
+    }
+    return loss/job->count;
+}
+
+static bool tune_load(TuneJob *job, const char *path){
+    PackedReader r;
+    if (!ffp_packed_reader_open(&r, path)){ fprintf(stderr, "cannot read %s\n", path); return false; }
+    job->features = malloc(r.count*FFP_EVAL_PARAMS + 1);
+    job->target = malloc(sizeof(float)*(r.count+1));
+    if (!job->features || !job->target){ ffp_packed_reader_close(&r); return false; }
+    Position pos; PackedInfo info;
+    while (ffp_packed_reader_next(&r, &pos, &info)){
+        float y;
+        if (info.result) y = info.result==FFP_RESULT_WHITE_WIN ? 1.0f : info.result==FFP_RESULT_DRAW ? 0.5f : 0.0f;
+        else if (info.has_score) y = (float)(1.0/(1.0+pow(10.0, -info.score/400.0)));
+        else continue;
+        eval_features(&pos, job->features + job->count*FFP_EVAL_PARAMS);
+        job->target[job->count++] = y;
+    }
+    ffp_packed_reader_close(&r);
+    return true;
+}
+
+static int cmd_tune(const char *path, const CliOptions *opt){
+    TuneJob job = {0};
+    job.threads = opt->threads>TUNE_MAX_THREADS ? TUNE_MAX_THREADS : opt->threads;
+    double t0 = wall_seconds();
+    if (!tune_load(&job, path)) return 1;
+    if (!job.count){ fprintf(stderr, "%s: no labelled positions\n", path); return 1; }
+    fprintf(stderr, "tune: %zu positions loaded in %.3fs\n", job.count, wall_seconds()-t0);
+    for (int j=0;j<FFP_EVAL_PARAMS;j++) job.params[j] = ffp_eval_params[j];
+
+    // Fit k for the starting weights (golden-section search on [0.05,4])
+    double a=0.05, b=4.0, g=0.6180339887498949;
+    for (int it=0; it<40; it++){
+        double c=b-g*(b-a), d=a+g*(b-a), lc, ld;
+        job.k=c; lc=tune_loss(&job, NULL);
+        job.k=d; ld=tune_loss(&job, NULL);
+        if (lc<ld) b=d; else a=c;
+    }
+    job.k=(a+b)/2;
+    fprintf(stderr, "tune: k = %.4f, initial loss %.6f\n", job.k, tune_loss(&job, NULL));
+
+    int epochs = opt->epochs>0 ? opt->epochs : 500;
+    double lr = opt->lr>0 ? opt->lr : 2.0;
+    const double b1=0.9, b2=0.999, eps=1e-8;
+    double m[FFP_EVAL_PARAMS]={0}, v[FFP_EVAL_PARAMS]={0}, grad[FFP_EVAL_PARAMS], loss=0;
+    t0 = wall_seconds();
+    for (int e=1; e<=epochs; e++){
+        loss = tune_loss(&job, grad);
+        for (int j=0;j<FFP_EVAL_PARAMS;j++){
+            m[j] = b1*m[j] + (1-b1)*grad[j];
+            v[j] = b2*v[j] + (1-b2)*grad[j]*grad[j];
+            double mh = m[j]/(1-pow(b1, e)), vh = v[j]/(1-pow(b2, e));
+            job.params[j] -= lr*mh/(sqrt(vh)+eps);
+        }
+        if (e%50==0 || e==epochs)
+            fprintf(stderr, "epoch %d  loss %.6f  (%.3fs/epoch)\n", e, loss, (wall_seconds()-t0)/e);
+    }
+    printf("int ffp_eval_params[FFP_EVAL_PARAMS]={");
+    for (int j=0;j<FFP_EVAL_PARAMS;j++) printf(j?",%d":"%d", (int)lround(job.params[j]));
+    printf("}; // loss %.6f, k %.4f, %zu positions\n", loss, job.k, job.count);
+    free(job.features); free(job.target);
+    return 0;
+}
+
+// Dataset deduplication by Zobrist key, keeping the first occurrence. Keys go
+// into an open-addressing set; if the set outgrows --memory the input is
+// re-scanned with an external sort: sorted (key,index) runs in temporary
+// files, a k-way merge that marks the first index of every key in a bitmap,
+// then a final pass that copies the marked records.
+typedef struct { U64 key; uint64_t index; } DedupeEntry;
+
+static bool dedupe_canonical(const PackedPosition *in, bool mirror, PackedPosition *out, U64 *key, bool *flipped){
+    Position pos; PackedInfo info;
+    if (!ffp_position_unpack(in, &pos, &info)) return false;
+    *flipped = false;
+    if (mirror && pos.side==BLACK){
+        ffp_position_mirror(&pos, &pos);
+        info.score = (int16_t)-info.score;
+        if (info.result==FFP_RESULT_WHITE_WIN || info.result==FFP_RESULT_BLACK_WIN) info.result = FFP_RESULT_WHITE_WIN+FFP_RESULT_BLACK_WIN-info.result;
+        if (info.move) info.move = (uint16_t)((info.move&0xF000) | ((info.move&63)^56) | ((((info.move>>6)&63)^56)<<6));
+        *flipped = true;
+    }
+    *key = pos.key ? pos.key : 1;   // 0 marks an empty slot
+    return ffp_position_pack(&pos, &info, out);
+}
+
+static int cmp_dedupe(const void *a, const void *b){
+    const DedupeEntry *x=a, *y=b;
+    if (x->key!=y->key) return x->key<y->key ? -1 : 1;
+    return (x->index>y->index)-(x->index<y->index);
+}
+
+static bool dedupe_flush_run(DedupeEntry *buf, size_t n, FILE ***runs, int *run_count){
+    qsort(buf, n, sizeof(DedupeEntry), cmp_dedupe);
+    size_t w=0;
+    for (size_t i=0;i<n;i++) if (!w || buf[w-1].key!=buf[i].key) buf[w++]=buf[i];
+    FILE *f = tmpfile();
+    FILE **r = realloc(*runs, sizeof(FILE*)*(*run_count+1));
+    if (!r){ if (f) fclose(f); return false; }
+    *runs = r;
+    if (!f || fwrite(buf, sizeof(DedupeEntry), w, f)!=w || fflush(f) || fseek(f, 0, SEEK_SET)){ if (f) fclose(f); return false; }
+    r[(*run_count)++] = f;
+    return true;
+}
+
+// Returns a bitmap of the indices to keep, or NULL on failure
+static uint64_t *dedupe_external(const PackedReader *r, bool mirror, size_t budget, int *run_count){
+    size_t cap = budget/sizeof(DedupeEntry);
+    if (cap<1024) cap=1024;
+    DedupeEntry *buf = malloc(sizeof(DedupeEntry)*cap);
+    uint64_t *keep = calloc(r->count/64+1, sizeof(uint64_t));
+    FILE **runs=NULL; *run_count=0;
+    bool ok = buf && keep;
+    size_t n=0;
+    for (size_t i=0; ok && i<r->count; i++){
+        PackedPosition pp; U64 key; bool flipped;
+        if (!dedupe_canonical(&r->records[i], mirror, &pp, &key, &flipped)) continue;
+        buf[n++] = (DedupeEntry){ key, i };
+        if (n==cap){ ok = dedupe_flush_run(buf, n, &runs, run_count); n=0; }
+    }
+    if (ok && n) ok = dedupe_flush_run(buf, n, &runs, run_count);
+    free(buf);
+    // k-way merge over a binary min-heap of run heads
+    DedupeEntry *head = malloc(sizeof(DedupeEntry)*(*run_count+1));
+    int *heap = malloc(sizeof(int)*(*run_count+1)), hn=0;
+    ok = ok && head && heap;
+    for (int k=0; ok && k<*run_count; k++){
+        if (fread(&head[k], sizeof(DedupeEntry), 1, runs[k])!=1) continue;
+        int c=hn++;
+        for (; c && cmp_dedupe(&head[k], &head[heap[(c-1)/2]])<0; c=(c-1)/2) heap[c]=heap[(c-1)/2];
+        heap[c]=k;
+    }
+    U64 last=0;
+    while (ok && hn){
+        int k=heap[0];
+        if (head[k].key!=last){ keep[head[k].index/64] |= 1ULL<<(head[k].index%64); last=head[k].key; }
+        if (fread(&head[k], sizeof(DedupeEntry), 1, runs[k])!=1) k=heap[--hn];
+        int c=0;
+        for (int l; (l=2*c+1)<hn; c=l){
+            if (l+1<hn && cmp_dedupe(&head[heap[l+1]], &head[heap[l]])<0) l++;
+            if (cmp_dedupe(&head[heap[l]], &head[k])>=0) break;
+            heap[c]=heap[l];
+        }
+        if (hn) heap[c]=k;
+    }
+    for (int k=0;k<*run_count;k++) fclose(runs[k]);
+    free(runs); free(head); free(heap);
+    if (!ok){ free(keep); return NULL; }
+    return keep;
+}
+
+static int cmd_dedupe(const char *in, const char *out, const CliOptions *opt){
+    PackedReader r;
+    if (!ffp_packed_reader_open(&r, in)){ fprintf(stderr, "cannot read %s\n", in); return 1; }
+    size_t budget = (size_t)(opt->memory_mb>0 ? opt->memory_mb : 1024) << 20;
+    size_t slots=1024;
+    while (slots*2*sizeof(U64)<=budget) slots*=2;
+    size_t max_fill = slots/4*3;
+    U64 *set = calloc(slots, sizeof(U64));
+    PackedWriter w;
+    if (!set || !ffp_packed_writer_open(&w, out)){ fprintf(stderr, "cannot write %s\n", out); free(set); ffp_packed_reader_close(&r); return 1; }
+    double t0 = wall_seconds();
+    uint64_t unique=0, flips=0, invalid=0;
+    bool spilled=false;
+    for (size_t i=0;i<r.count;i++){
+        PackedPosition pp; U64 key; bool flipped;
+        if (!dedupe_canonical(&r.records[i], opt->mirror, &pp, &key, &flipped)){ invalid++; continue; }
+        size_t h = key & (slots-1);
+        while (set[h] && set[h]!=key) h = (h+1) & (slots-1);
+        if (set[h]) continue;
+        if (unique==max_fill){ spilled=true; break; }
+        set[h]=key; unique++; flips+=flipped;
+        ffp_packed_writer_write(&w, &pp, 1);
+    }
+    free(set);
+    int runs=0;
+    if (spilled){
+        // Start the output again from the external pass
+        ffp_packed_writer_close(&w);
+        uint64_t *keep = dedupe_external(&r, opt->mirror, budget, &runs);
+        if (!keep || !ffp_packed_writer_open(&w, out)){ fprintf(stderr, "external dedupe of %s failed\n", in); free(keep); ffp_packed_reader_close(&r); return 1; }
+        unique=flips=invalid=0;
+        for (size_t i=0;i<r.count;i++){
+            PackedPosition pp; U64 key; bool flipped;
+            if (!dedupe_canonical(&r.records[i], opt->mirror, &pp, &key, &flipped)){ invalid++; continue; }
+            if (!(keep[i/64]>>(i%64)&1)) continue;
+            unique++; flips+=flipped;
+            ffp_packed_writer_write(&w, &pp, 1);
+        }
+        free(keep);
+    }
+    bool ok = ffp_packed_writer_close(&w);
+    double sec = wall_seconds()-t0;
+    printf("dedupe: %zu -> %llu positions (%llu duplicates, %llu mirrored, %llu invalid), %s  (%.3fs)\n",
+           r.count, (unsigned long long)unique, (unsigned long long)(r.count-unique-invalid),
+           (unsigned long long)flips, (unsigned long long)invalid,
+           spilled ? "external sort" : "in memory", sec);
+    if (spilled) fprintf(stderr, "dedupe: %d sorted runs spilled\n", runs);
+    ffp_packed_reader_close(&r);
+    if (!ok){ fprintf(stderr, "writing %s failed\n", out); return 1; }
+    return 0;
+}
+
+// Book building: PGN games are replayed in parallel and every (Polyglot key,
+// move) pair up to --max-ply is counted with the result from the mover's side
+// in one of BOOK_SHARDS mutex-protected open-addressing maps. Shards start at
+// BOOK_SHARD_START slots and double while their share of the --memory budget
+// allows; a shard that fills up at that size is sorted and spilled to a
+// temporary run. At the end all runs are merged, pairs below --min-games are
+// dropped and the weights (2 per win, 1 per draw, scaled per position to 16
+// bits) are written sorted by key.
+#define BOOK_SHARDS 64
+#define BOOK_SHARD_START 1024
+
+typedef struct {
+    U64 key;
+    uint16_t move;              // Polyglot encoding, 0 = empty slot
+    uint32_t wins, draws, losses;
+} BookCount;
+
+typedef struct {
+    pthread_mutex_t lock;
+    BookCount *slots;
+    size_t mask, used, limit;
+    size_t max_slots;           // this shard's share of the memory budget
+    FILE *spill;                // sorted runs appended back to back
+    size_t *run_end;            // end of each run, in entries
+    int run_count;
+    bool failed;
+} BookShard;
+
+typedef struct {
+    BookShard shard[BOOK_SHARDS];
+    int max_ply;
+} BookBuild;
+
+static uint16_t polyglot_move(const Move *m){
+    int to=m->to;
+    if (m->flags & MF_CASTLE) to = to>m->from ? m->from+3 : m->from-4; // king takes rook
+    int promo = (m->flags & MF_PROMO) ? (int[]){0,3,1,2,4,0}[type_of_piece(m->promo)] : 0;
+    return (uint16_t)(to%8 | (7-to/8)<<3 | (m->from%8)<<6 | (7-m->from/8)<<9 | promo<<12);
+}
+
+static U64 book_hash(U64 key, uint16_t move){ return (key ^ move*0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL; }
+
+// Doubles the map; false once the budget is reached (or memory runs out)
+static bool book_shard_grow(BookShard *sh){
+    size_t slots = (sh->mask+1)*2;
+    BookCount *t = slots<=sh->max_slots ? calloc(slots, sizeof(BookCount)) : NULL;
+    if (!t) return false;
+    for (size_t i=0;i<=sh->mask;i++){
+        if (!sh->slots[i].move) continue;
+        size_t j = book_hash(sh->slots[i].key, sh->slots[i].move) & (slots-1);
+        while (t[j].move) j = (j+1) & (slots-1);
+        t[j] = sh->slots[i];
+    }
+    free(sh->slots);
+    sh->slots = t;
+    sh->mask = slots-1; sh->limit = slots/4*3;
+    return true;
+}
+
+static int cmp_book_count(const void *a, const void *b){
+    const BookCount *x=a, *y=b;
+    if (x->key!=y->key) return x->key<y->key ? -1 : 1;
+    return (x->move>y->move)-(x->move<y->move);
+}
+
+// Sorts the occupied slots to the front; returns their number
+static size_t book_shard_compact(BookShard *sh){
+    size_t n=0;
+    for (size_t i=0;i<=sh->mask;i++) if (sh->slots[i].move) sh->slots[n++]=sh->slots[i];
+    qsort(sh->slots, n, sizeof(BookCount), cmp_book_count);
+    return n;
+}
+
+static void book_shard_spill(BookShard *sh){
+    size_t n = book_shard_compact(sh);
+    size_t *r = realloc(sh->run_end, sizeof(size_t)*(sh->run_count+1));
+    if (r) sh->run_end = r;
+    if (!sh->spill) sh->spill = tmpfile();
+    if (!r || !sh->spill || fwrite(sh->slots, sizeof(BookCount), n, sh->spill)!=n) sh->failed=true;
+    else {
+        sh->run_end[sh->run_count] = (sh->run_count ? sh->run_end[sh->run_count-1] : 0) + n;
+        sh->run_count++;
+    }
+    memset(sh->slots, 0, sizeof(BookCount)*(sh->mask+1));
+    sh->used=0;
+}
+
+// Buffered reader over one run of a shard's spill file
+typedef struct { int fd; size_t next, end, n, i; BookCount buf[256]; } BookRun;
+
+static bool book_run_next(BookRun *r, BookCount *out){
+    if (r->i==r->n){
+        if (r->next==r->end) return false;
+        size_t want = r->end-r->next < 256 ? r->end-r->next : 256;
+        ssize_t got = pread(r->fd, r->buf, want*sizeof(BookCount), (off_t)(r->next*sizeof(BookCount)));
+        if (got<(ssize_t)sizeof(BookCount)) return false;
+        r->n = (size_t)got/sizeof(BookCount); r->i=0; r->next += r->n;
+    }
+    *out = r->buf[r->i++];
+    return true;
+}
+
+static bool book_on_move(const PgnGame *game, const Position *pos, const Move *move, void *user){
+    BookBuild *bb=(BookBuild*)user;
+    if (game->plies>=bb->max_ply || game->result==FFP_RESULT_NONE) return false;
+    U64 key = ffp_polyglot_key(pos);
+    uint16_t pm = polyglot_move(move);
+    U64 h = book_hash(key, pm);
+    BookShard *sh = &bb->shard[h>>58];
+    int mover = pos->side==WHITE ? FFP_RESULT_WHITE_WIN : FFP_RESULT_BLACK_WIN;
+    pthread_mutex_lock(&sh->lock);
+    size_t i = h & sh->mask;
+    while (sh->slots[i].move && (sh->slots[i].key!=key || sh->slots[i].move!=pm)) i = (i+1) & sh->mask;
+    if (!sh->slots[i].move){
+        if (sh->used==sh->limit){
+            if (!book_shard_grow(sh)) book_shard_spill(sh);
+            for (i = h & sh->mask; sh->slots[i].move; i = (i+1) & sh->mask) {}
+        }
+        sh->slots[i] = (BookCount){ .key=key, .move=pm };
+        sh->used++;
+    }
+    BookCount *c = &sh->slots[i];
+    if (game->result==FFP_RESULT_DRAW) c->draws++;
+    else if (game->result==mover) c->wins++;
+    else c->losses++;
+    pthread_mutex_unlock(&sh->lock);
+    return true;
+}
+
+typedef struct { FILE *fp; int min_games; uint64_t positions, entries; BookCount group[256]; int group_n; bool failed; } BookOut;
+
+static void book_put(FILE *f, uint64_t v, int n){ for (int i=n-1;i>=0;i--) fputc((int)(v>>(8*i)) & 255, f); }
+
+static void book_flush_group(BookOut *o){
+    uint32_t w[256], max=0;
+    int n=0;
+    for (int i=0;i<o->group_n;i++){
+        const BookCount *c=&o->group[i];
+        if (c->wins+c->draws+c->losses < (uint32_t)o->min_games) continue;
+        uint32_t weight = 2*c->wins + c->draws;
+        if (!weight) continue;
+        o->group[n]=*c; w[n++]=weight;
+        if (weight>max) max=weight;
+    }
+    // Highest weight first, as Polyglot tools do
+    for (int i=1;i<n;i++) for (int j=i; j>0 && w[j]>w[j-1]; j--){
+        uint32_t t=w[j]; w[j]=w[j-1]; w[j-1]=t;
+        BookCount c=o->group[j]; o->group[j]=o->group[j-1]; o->group[j-1]=c;
+    }
+    for (int i=0;i<n;i++){
+        uint32_t weight = max>65535 ? (uint32_t)((uint64_t)w[i]*65535/max) : w[i];
+        book_put(o->fp, o->group[i].key, 8);
+        book_put(o->fp, o->group[i].move, 2);
+        book_put(o->fp, weight ? weight : 1, 2);
+        book_put(o->fp, 0, 4);
+    }
+    if (n){ o->positions++; o->entries+=n; }
+    o->group_n=0;
+}
+
+// Takes (key, move) pairs in sorted order; equal pairs are summed
+static void book_emit(BookOut *o, const BookCount *c){
+    if (o->group_n && o->group[0].key!=c->key) book_flush_group(o);
+    BookCount *last = o->group_n ? &o->group[o->group_n-1] : NULL;
+    if (last && last->move==c->move){ last->wins+=c->wins; last->draws+=c->draws; last->losses+=c->losses; }
+    else if (o->group_n<256) o->group[o->group_n++]=*c;
+}
+
+static int cmd_book_build(const char *in, const char *out, const CliOptions *opt){
+    BookBuild *bb = calloc(1, sizeof(BookBuild));
+    if (!bb) return 1;
+    bb->max_ply = opt->max_ply>0 ? opt->max_ply : 20;
+    size_t budget = (size_t)(opt->memory_mb>0 ? opt->memory_mb : 1024) << 20, slots=1024;
+    while (slots*2*sizeof(BookCount)*BOOK_SHARDS <= budget) slots*=2;
+    bool ok=true;
+    for (int s=0;s<BOOK_SHARDS;s++){
+        BookShard *sh=&bb->shard[s];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->slots = calloc(BOOK_SHARD_START, sizeof(BookCount));
+        sh->mask = BOOK_SHARD_START-1; sh->limit = BOOK_SHARD_START/4*3;
+        sh->max_slots = slots;
+        ok = ok && sh->slots;
+    }
+    PgnStats st;
+    PgnCallbacks cb = { book_on_move, NULL, bb };
+    BookOut o = { .min_games = opt->min_games>0 ? opt->min_games : 1 };
+    if (ok && !ffp_pgn_read_file(in, opt->threads, &cb, &st)){ fprintf(stderr, "cannot read %s\n", in); ok=false; }
+    if (ok && !(o.fp = fopen(out, "wb"))){ fprintf(stderr, "cannot write %s\n", out); ok=false; }
+    double t0 = wall_seconds();
+    int runs=0;
+    for (int s=0;s<BOOK_SHARDS;s++){ runs += bb->shard[s].run_count; ok = ok && !bb->shard[s].failed; }
+    if (ok && !runs){
+        // Everything fit: shards hold disjoint pairs, so one sort of their union is enough
+        size_t total=0;
+        for (int s=0;s<BOOK_SHARDS;s++) total += bb->shard[s].used;
+        BookCount *all = malloc(sizeof(BookCount)*(total+1));
+        if (!all) ok=false;
+        for (int s=0, n=0; ok && s<BOOK_SHARDS; s++)
+            for (size_t i=0;i<=bb->shard[s].mask;i++) if (bb->shard[s].slots[i].move) all[n++]=bb->shard[s].slots[i];
+        if (ok){
+            qsort(all, total, sizeof(BookCount), cmp_book_count);
+            for (size_t i=0;i<total;i++) book_emit(&o, &all[i]);
+        }
+        free(all);
+    } else if (ok){
+        // External merge: spill what is left so every pair lives in some sorted run
+        for (int s=0;s<BOOK_SHARDS;s++) if (bb->shard[s].used) book_shard_spill(&bb->shard[s]);
+        int nf=0;
+        for (int s=0;s<BOOK_SHARDS;s++){
+            ok = ok && !bb->shard[s].failed && (!bb->shard[s].spill || fflush(bb->shard[s].spill)==0);
+            nf += bb->shard[s].run_count;
+        }
+        BookRun *files = ok ? malloc(sizeof(BookRun)*(nf+1)) : NULL;
+        ok = ok && files;
+        for (int s=0, k=0; ok && s<BOOK_SHARDS; s++)
+            for (int r=0;r<bb->shard[s].run_count;r++,k++)
+                files[k] = (BookRun){ .fd=fileno(bb->shard[s].spill), .next = r ? bb->shard[s].run_end[r-1] : 0, .end = bb->shard[s].run_end[r] };
+        runs=nf;
+        BookCount *head = malloc(sizeof(BookCount)*(nf+1));
+        int *heap = malloc(sizeof(int)*(nf+1)), hn=0;
+        ok = ok && head && heap;
+        for (int k=0; ok && k<nf; k++){
+            if (!book_run_next(&files[k], &head[k])) continue;
+            int c=hn++;
+            for (; c && cmp_book_count(&head[k], &head[heap[(c-1)/2]])<0; c=(c-1)/2) heap[c]=heap[(c-1)/2];
+            heap[c]=k;
+        }
+        while (ok && hn){
+            int k=heap[0];
+            book_emit(&o, &head[k]);
+            if (!book_run_next(&files[k], &head[k])) k=heap[--hn];
+            int c=0;
+            for (int l; (l=2*c+1)<hn; c=l){
+                if (l+1<hn && cmp_book_count(&head[heap[l+1]], &head[heap[l]])<0) l++;
+                if (cmp_book_count(&head[heap[l]], &head[k])>=0) break;
+                heap[c]=heap[l];
+            }
+            if (hn) heap[c]=k;
+        }
+        free(files); free(head); free(heap);
+    }
+    if (o.fp){
+        if (ok && o.group_n) book_flush_group(&o);
+        ok = !ferror(o.fp) && ok;
+        ok = fclose(o.fp)==0 && ok;
+    }
+    for (int s=0;s<BOOK_SHARDS;s++){
+        if (bb->shard[s].spill) fclose(bb->shard[s].spill);
+        free(bb->shard[s].run_end); free(bb->shard[s].slots);
+        pthread_mutex_destroy(&bb->shard[s].lock);
+    }
+    free(bb);
+    if (!ok){ fprintf(stderr, "building %s failed\n", out); return 1; }
+    printf("book: %llu games (%.3fs), %llu positions, %llu entries%s  (write %.3fs)\n",
+           (unsigned long long)st.games, st.seconds, (unsigned long long)o.positions, (unsigned long long)o.entries,
+           runs ? ", external merge" : "", wall_seconds()-t0);
+    if (runs) fprintf(stderr, "book: %d sorted runs spilled\n", runs);
+    return 0;
+}
+
+// Benchmark results: named metrics with repeated samples and an optional
+// signature (node count) that must not change. Saved as JSON; a compare runs
+// Welch's t-test per metric and fails on a significant slowdown beyond the
+// threshold, on any signature change, or when the metric sets differ.
+#define BENCH_MAX_SAMPLES 64
+
+typedef struct {
+    char name[64];
+    bool higher_is_better;
+    uint64_t signature;         // 0 = none
+    int n;
+    double samples[BENCH_MAX_SAMPLES];
+} BenchMetric;
+
+typedef struct {
+    BenchMetric *m;
+    int count, cap;
+} BenchReport;
+
+static BenchMetric *bench_metric(BenchReport *r, const char *name, bool higher_is_better, uint64_t signature){
+    for (int i=0;i<r->count;i++) if (!strcmp(r->m[i].name, name)) return &r->m[i];
+    if (r->count==r->cap){
+        BenchMetric *n = realloc(r->m, sizeof(BenchMetric)*(r->cap = r->cap ? r->cap*2 : 16));
+        if (!n) return NULL;
+        r->m = n;
+    }
+    BenchMetric *m = &r->m[r->count++];
+    memset(m, 0, sizeof(*m));
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->higher_is_better = higher_is_better;
+    m->signature = signature;
+    return m;
+}
+
+static void bench_sample(BenchMetric *m, double v){ if (m && m->n<BENCH_MAX_SAMPLES) m->samples[m->n++] = v; }
+
+static void bench_stats(const BenchMetric *m, double *mean, double *var){
+    double s=0, q=0;
+    if (!m){ *mean = *var = 0; return; }
+    for (int i=0;i<m->n;i++) s += m->samples[i];
+    *mean = m->n ? s/m->n : 0;
+    for (int i=0;i<m->n;i++) q += (m->samples[i]-*mean)*(m->samples[i]-*mean);
+    *var = m->n>1 ? q/(m->n-1) : 0;
+}
+
+// Two-sided 95% Student t quantile
+static double t_quantile(double df){
+    static const double T[30] = {12.706,4.303,3.182,2.776,2.571,2.447,2.365,2.306,2.262,2.228,2.201,2.179,2.160,2.145,2.131,
+                                 2.120,2.110,2.101,2.093,2.086,2.080,2.074,2.069,2.064,2.060,2.056,2.052,2.048,2.045,2.042};
+    int d = (int)df;
+    return d<1 ? T[0] : d<=30 ? T[d-1] : 1.96;
+}
+
+static bool bench_save(const BenchReport *r, const char *path){
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "{\"version\":1,\"benchmarks\":[\n");
+    for (int i=0;i<r->count;i++){
+        const BenchMetric *m=&r->m[i];
+        fprintf(f, "  {\"name\":");
+        put_json_string(f, m->name, (int)strlen(m->name));
+        fprintf(f, ",\"higher_is_better\":%s,\"signature\":%llu,\"samples\":[", m->higher_is_better ? "true" : "false",
+                (unsigned long long)m->signature);
+        for (int k=0;k<m->n;k++) fprintf(f, k ? ",%.6g" : "%.6g", m->samples[k]);
+        fprintf(f, "]}%s\n", i+1<r->count ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    return fclose(f)==0;
+}
+
+// Reads the files bench_save writes (not a general JSON parser)
+static bool bench_load(BenchReport *r, const char *path){
+    MappedFile file;
+    if (!ffp_file_map(&file, path)) return false;
+    char *text = malloc(file.size+1);
+    if (!text){ ffp_file_unmap(&file); return false; }
+    memcpy(text, file.data, file.size); text[file.size]=0;
+    ffp_file_unmap(&file);
+    for (char *p=text; (p=strstr(p, "{\"name\":\"")); ){
+        p += 9;
+        char *q = strchr(p, '"');
+        char *end = q ? strchr(q, '}') : NULL;
+        if (!end) break;
+        *q = 0; *end = 0;
+        char *h = strstr(q+1, "\"higher_is_better\":"), *sig = strstr(q+1, "\"signature\":"), *smp = strstr(q+1, "\"samples\":[");
+        BenchMetric *m = bench_metric(r, p, h && !strncmp(h+19, "true", 4), sig ? strtoull(sig+12, NULL, 10) : 0);
+        for (char *v = smp ? smp+11 : end; m && *v && *v!=']'; ){
+            char *e; double x = strtod(v, &e);
+            if (e==v) break;
+            bench_sample(m, x);
+            v = e + (*e==',');
+        }
+        p = end+1;
+    }
+    free(text);
+    return true;
+}
+
+static int bench_compare(const BenchReport *cur, const char *path, double threshold){
+    BenchReport base = {0};
+    if (!bench_load(&base, path)){ fprintf(stderr, "cannot read baseline %s\n", path); return 1; }
+    int failures=0, matched=0;
+    printf("\n%-32s %22s %22s %8s  %s\n", "benchmark", "baseline (95% CI)", "current (95% CI)", "delta", "verdict");
+    for (int i=0;i<cur->count;i++){
+        const BenchMetric *c=&cur->m[i], *b=NULL;
+        for (int k=0;k<base.count;k++) if (!strcmp(base.m[k].name, c->name)) b=&base.m[k];
+        double cm, cv, bm, bv;
+        bench_stats(c, &cm, &cv);
+        if (!b || !b->n){ printf("%-32s %22s %14.4g         %8s  new\n", c->name, "-", cm, ""); continue; }
+        matched++;
+        bench_stats(b, &bm, &bv);
+        double bci = b->n>1 ? t_quantile(b->n-1)*sqrt(bv/b->n) : 0, cci = c->n>1 ? t_quantile(c->n-1)*sqrt(cv/c->n) : 0;
+        double delta = bm ? (cm-bm)/bm*100.0 : 0;
+        double worse = c->higher_is_better ? -delta : delta;    // positive = slower
+        // Welch's t-test; with fewer than two samples on a side only the threshold applies
+        bool significant = true;
+        if (b->n>1 && c->n>1){
+            double sb=bv/b->n, sc=cv/c->n, se=sqrt(sb+sc);
+            double df = (sb+sc)*(sb+sc) / ((sb*sb)/(b->n-1) + (sc*sc)/(c->n-1) + 1e-300);
+            significant = se>0 ? fabs(cm-bm)/se > t_quantile(df) : cm!=bm;
+        }
+        const char *verdict = "ok";
+        if (b->signature!=c->signature){ verdict = "SIGNATURE CHANGED"; failures++; }
+        else if (significant && worse>threshold){ verdict = "SLOWER"; failures++; }
+        else if (significant && -worse>threshold) verdict = "faster";
+        else if (!significant && fabs(worse)>threshold) verdict = "ok (noise)";
+        printf("%-32s %12.4g ±%6.2f%% %12.4g ±%6.2f%% %+7.2f%%  %s", c->name, bm, bm ? bci/bm*100 : 0, cm, cm ? cci/cm*100 : 0, delta, verdict);
+        if (b->signature!=c->signature) printf(" (%llu -> %llu)", (unsigned long long)b->signature, (unsigned long long)c->signature);
+        printf("\n");
+    }
+    for (int k=0;k<base.count;k++){
+        bool found=false;
+        for (int i=0;i<cur->count && !found;i++) found = !strcmp(cur->m[i].name, base.m[k].name);
+        if (found || !base.m[k].n) continue;
+        double bm, bv;
+        bench_stats(&base.m[k], &bm, &bv);
+        printf("%-32s %12.4g         %22s %8s  MISSING\n", base.m[k].name, bm, "-", "");
+        failures++;
+    }
+    free(base.m);
+    printf("%d regression%s against %s (threshold %.1f%%)\n", failures, failures==1 ? "" : "s", path, threshold);
+    if (!matched) fprintf(stderr, "no benchmark in common with %s: nothing was compared\n", path);
+    return failures || !matched ? 1 : 0;
+}
+
+// Saves and/or compares a finished report; returns the exit status
+static int bench_finish(BenchReport *r, const char *save, const char *compare, double threshold, int status){
+    if (save && !bench_save(r, save)){ fprintf(stderr, "cannot write %s\n", save); status=1; }
+    if (compare && bench_compare(r, compare, threshold>=0 ? threshold : 3.0)) status=1;
+    free(r->m);
+    return status;
+}
+
+static int bench_runs(const CliOptions *opt){
+    return opt->bench_runs>0 ? opt->bench_runs : (opt->bench_save || opt->bench_compare) ? 5 : 1;
+}
+
+// Perft suite: well-known positions with published node counts
+static const struct { const char *name, *fen; int depth; uint64_t nodes; } PERFT_SUITE[] = {
+    { "startpos", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5, 4865609 },
+    { "kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4, 4085603 },
+    { "endgame", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624 },
+    { "promotions", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4, 422333 },
+    { "talkchess", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4, 2103487 },
+    { "middlegame", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4, 3894594 },
+};
+
+static int cmd_perft_suite(const CliOptions *opt){
+    BenchReport rep = {0};
+    int runs = bench_runs(opt), status=0;
+    for (size_t i=0;i<sizeof(PERFT_SUITE)/sizeof(PERFT_SUITE[0]);i++){
+        char name[64];
+        snprintf(name, sizeof(name), "perft.%s.nps", PERFT_SUITE[i].name);
+        BenchMetric *m = bench_metric(&rep, name, true, PERFT_SUITE[i].nodes);
+        uint64_t nodes = 0;
+        for (int r=0;r<runs;r++){
+            Position pos;
+            ffp_position_from_fen(&pos, PERFT_SUITE[i].fen);
+            double t0 = wall_seconds();
+            nodes = perft(&pos, PERFT_SUITE[i].depth);
+            double sec = wall_seconds()-t0;
+            if (m) m->signature = nodes;
+            bench_sample(m, sec>0 ? nodes/sec : 0);
+            if (nodes!=PERFT_SUITE[i].nodes){
+                fprintf(stderr, "perft %s depth %d: %llu nodes, expected %llu\n", PERFT_SUITE[i].name, PERFT_SUITE[i].depth,
+                        (unsigned long long)nodes, (unsigned long long)PERFT_SUITE[i].nodes);
+                status=1;
+            }
+        }
+        double mean, var; bench_stats(m, &mean, &var);
+        printf("%-12s depth %d  %10llu nodes  %6.2f Mnps%s\n", PERFT_SUITE[i].name, PERFT_SUITE[i].depth,
+               (unsigned long long)nodes, mean/1e6, nodes==PERFT_SUITE[i].nodes ? "" : "  WRONG");
+    }
+    return bench_finish(&rep, opt->bench_save, opt->bench_compare, opt->bench_threshold, status);
+}
+
+// Bench: fixed positions searched to a fixed depth, each with a freshly
+// cleared hash table, so the node total is the same for any thread count and
+// only changes when search behaviour does.
+static const char *BENCH_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "2K5/p7/7P/5pR1/8/5k2/r7/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "7k/3p2pp/4q3/8/4Q3/5Kp1/P6b/8 w - - 0 1",
+    "8/2p5/8/2kPKp1p/2p4P/2P5/3P4/8 w - - 0 1",
+    "8/1p3pp1/7p/5P1P/2k3P1/8/2K2P2/8 w - - 0 1",
+    "8/pp2r1k1/2p1p3/3pP2p/1P1P1P1P/P5KR/8/8 w - - 0 1",
+    "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "6k1/6p1/P6p/r1N5/5p2/7P/1b3PP1/4R1K1 w - - 0 1",
+    "1r3k2/4q3/2Pp3b/3Bp3/2Q2p2/1p1P2P1/1P2KP2/3N4 w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "8/3p3B/5p2/5P2/p7/PP5b/k7/6K1 w - - 0 1",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "4rrk1/1p1nq3/p7/2p1P1pp/3P2bp/3Q1Bn1/PPPB4/1K2R1NR w - - 40 21",
+    "r3k2r/3nnpbp/q2pp1p1/p7/Pp1PPPP1/4BNN1/1P5P/R2Q1RK1 w kq - 0 16",
+    "3Qb1k1/1r2ppb1/pN1n2q1/Pp1Pp1Pr/4P2p/4BP2/4B1R1/1R5K b - - 11 40",
+    "4k3/3q1r2/1N2r1b1/3ppN2/2nPP3/1B1R2n1/2R1Q3/3K4 w - - 5 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r1bqkbnr/pppp1Qpp/2n5/4p3/2B1P3/8/PPPP1PPP/RNB1K1NR b KQkq - 0 4",
+    "7k/7P/6K1/8/3B4/8/8/8 b - - 0 1",
+    "8/8/8/8/8/6k1/6p1/6K1 w - - 0 1",
+    "n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b - - 0 1",
+};
+#define BENCH_COUNT ((int)(sizeof(BENCH_FENS)/sizeof(BENCH_FENS[0])))
+
+// ISA the hot kernels run with, for the bench header
+static const char *isa_name(void){
+#if defined(FFP_DISPATCH) && defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v3")) return "avx2 (dispatch)";
+    if (__builtin_cpu_supports("popcnt")) return "popcnt (dispatch)";
+    return "x86-64 (dispatch)";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__BMI2__)
+    return "bmi2";
+#elif defined(__POPCNT__)
+    return "popcnt";
+#else
+    return "generic";
+#endif
+}
+
+// Per-thread counters on their own cache lines
+typedef struct {
+    _Alignas(64) SearchStats s;
+} ThreadStats;
+
+typedef struct {
+    int depth, hash_mb;
+    atomic_int next;
+    uint64_t nodes[BENCH_COUNT];
+    Move best[BENCH_COUNT];
+    ThreadStats *stats;         // One per worker, NULL without --search-stats
+} BenchJob;
+
+static void bench_worker(int worker, void *arg){
+    BenchJob *job=(BenchJob*)arg;
+    HashTable tt;
+    SearchLimits limits = { .max_depth = job->depth, .stats = job->stats ? &job->stats[worker].s : NULL };
+    if (job->hash_mb>0 && ffp_hash_init(&tt, (size_t)job->hash_mb)) limits.hash=&tt;
+    for (int i; (i = atomic_fetch_add(&job->next, 1)) < BENCH_COUNT; ){
+        Position pos;
+        ffp_position_from_fen(&pos, BENCH_FENS[i]);
+        uint64_t tr = trace_now();
+        if (limits.hash) ffp_hash_clear(limits.hash);
+        SearchResult res = ffp_search(&pos, &limits);
+        TRACE_SPAN("position", tr, "index", i);
+        job->nodes[i] = res.nodes;
+        job->best[i] = res.best_move;
+    }
+    if (limits.hash) ffp_hash_free(&tt);
+}
+
+static int cmd_bench(int depth, int threads, int hash_mb, const CliOptions *opt){
+    BenchJob *job = calloc(1, sizeof(BenchJob));
+    if (!job) return 1;
+    job->depth = depth>0 ? depth : 4;
+    job->hash_mb = hash_mb;
+    if (opt->search_stats && !(job->stats = aligned_alloc(64, threads*sizeof(ThreadStats)))){ free(job); return 1; }
+    BenchReport rep = {0};
+    BenchMetric *m = NULL;
+    int runs = bench_runs(opt);
+    double sec = 0;
+    for (int r=0;r<runs;r++){
+        atomic_init(&job->next, 0);
+        if (job->stats) memset(job->stats, 0, threads*sizeof(ThreadStats));
+        double t0 = wall_seconds();
+        run_workers(threads, bench_worker, job);
+        sec = wall_seconds()-t0;
+        uint64_t nodes=0;
+        for (int i=0;i<BENCH_COUNT;i++) nodes += job->nodes[i];
+        if (!m){
+            char name[64];
+            snprintf(name, sizeof(name), "bench.d%d.t%d.nps", job->depth, threads);
+            m = bench_metric(&rep, name, true, nodes);
+        }
+        bench_sample(m, sec>0 ? nodes/sec : 0);
+    }
+    uint64_t total=0;
+    for (int i=0;i<BENCH_COUNT;i++){
+        char mv[6]; ffp_move_to_string(&job->best[i], mv);
+        fprintf(stderr, "position %2d/%d  nodes %10llu  best %-5s  %s\n", i+1, BENCH_COUNT,
+                (unsigned long long)job->nodes[i], mv[0] ? mv : "-", BENCH_FENS[i]);
+        total += job->nodes[i];
+    }
+    printf("depth %d, threads %d, hash %d MB, isa %s\n", job->depth, threads, hash_mb, isa_name());
+    printf("Total time (ms) : %.0f\n", sec*1000.0);
+    printf("Nodes searched  : %llu\n", (unsigned long long)total);
+    printf("Nodes/second    : %.0f\n", sec>0 ? total/sec : 0);
+    if (runs>1){
+        double mean, var; bench_stats(m, &mean, &var);
+        printf("Mean over %d runs: %.0f nps (sd %.0f)\n", runs, mean, sqrt(var));
+    }
+    if (job->stats){
+        SearchStats total_stats = {0};
+        for (int t=0;t<threads;t++) ffp_search_stats_merge(&total_stats, &job->stats[t].s);
+        cli_search_stats(&total_stats);
+        free(job->stats);
+    }
+    free(job);
+    return bench_finish(&rep, opt->bench_save, opt->bench_compare, opt->bench_threshold, 0);
+}
+
+#ifdef FFP_BENCH_MICRO
+// Microbenchmarks (make bench_micro): every primitive runs over a recorded
+// position set; each repetition times the whole set, and the per-op figures
+// of the repetitions are summarised as median and percentiles.
+
+// Second slider backend for comparison: classical ray tables, nearest blocker
+// found by bit scan (forward for increasing square numbers, reverse otherwise)
+static U64 RAY_TABLE[8][64];   // N, S, E, W, NE, NW, SE, SW
+static const int RAY_FORWARD[8] = {0, 1, 1, 0, 0, 0, 1, 1};
+
+static void ray_tables_init(void){
+    U64 (*const step[8])(U64) = { shift_north, shift_south, shift_east, shift_west, shift_ne, shift_nw, shift_se, shift_sw };
+    for (int d=0;d<8;d++) for (int sq=0;sq<64;sq++){
+        U64 a=0;
+        for (U64 x=step[d](1ULL<<sq); x; x=step[d](x)) a|=x;
+        RAY_TABLE[d][sq]=a;
+    }
+}
+
+static inline U64 table_ray(int d, int sq, U64 occ){
+    U64 a = RAY_TABLE[d][sq], b = a & occ;
+    if (!b) return a;
+    int first = RAY_FORWARD[d] ? LSB_INDEX(b) : MSB_INDEX(b);
+    return a ^ RAY_TABLE[d][first];
+}
+
+static U64 rook_table(int sq, U64 occ){ return table_ray(0,sq,occ)|table_ray(1,sq,occ)|table_ray(2,sq,occ)|table_ray(3,sq,occ); }
+static U64 bishop_table(int sq, U64 occ){ return table_ray(4,sq,occ)|table_ray(5,sq,occ)|table_ray(6,sq,occ)|table_ray(7,sq,occ); }
+static U64 rook_loop(int sq, U64 occ){ return rook_attacks_from(1ULL<<sq, occ); }
+static U64 bishop_loop(int sq, U64 occ){ return bishop_attacks_from(1ULL<<sq, occ); }
+
+typedef struct {
+    Position *pos;
+    size_t count, cap;
+} MicroSet;
+
+static bool micro_add(MicroSet *set, const Position *pos){
+    if (set->count==set->cap){
+        Position *n = realloc(set->pos, sizeof(Position)*(set->cap = set->cap ? set->cap*2 : 1024));
+        if (!n) return false;
+        set->pos = n;
+    }
+    set->pos[set->count++] = *pos;
+    return true;
+}
+
+static bool micro_add_epd(const EpdRecord *rec, void *user){ return micro_add((MicroSet*)user, &rec->pos); }
+
+static volatile U64 micro_sink;
+
+typedef enum { MB_PSEUDO, MB_LEGAL, MB_MAKE, MB_ATTACKED, MB_ROOK_LOOP, MB_ROOK_TABLE, MB_BISHOP_LOOP, MB_BISHOP_TABLE, MB_COUNT } MicroKind;
+static const char *MICRO_NAMES[MB_COUNT] = {
+    "generate_pseudo_legal", "generate_legal", "make+unmake", "is_square_attacked",
+    "rook attacks (loop)", "rook attacks (table)", "bishop attacks (loop)", "bishop attacks (table)"
+};
+static const char *MICRO_IDS[MB_COUNT] = {
+    "pseudo_legal", "legal", "make_unmake", "is_square_attacked", "rook_loop", "rook_table", "bishop_loop", "bishop_table"
+};
+
+// One pass over the set; returns the number of operations performed
+static uint64_t micro_pass(const MicroSet *set, MicroKind kind){
+    uint64_t ops=0;
+    U64 acc=0;
+    MoveList ml;
+    for (size_t i=0;i<set->count;i++){
+        const Position *p = &set->pos[i];
+        switch (kind){
+        case MB_PSEUDO: ffp_generate_pseudo_legal(p, &ml); acc+=ml.count; ops++; break;
+        case MB_LEGAL:  ffp_generate_legal(p, &ml); acc+=ml.count; ops++; break;
+        case MB_MAKE: {
+            Position q = *p;
+            ffp_generate_pseudo_legal(&q, &ml);
+            for (int m=0;m<ml.count;m++){ Undo u; ffp_make_move(&q, ml.list[m], &u); acc^=q.key; ffp_unmake_move(&q, ml.list[m], &u); }
+            ops += ml.count;
+            break;
+        }
+        case MB_ATTACKED:
+            for (int sq=0;sq<64;sq++) acc += ffp_is_square_attacked(p, sq, (sq&1) ? WHITE : BLACK);
+            ops += 64;
+            break;
+        default: {
+            U64 (*fn)(int, U64) = kind==MB_ROOK_LOOP ? rook_loop : kind==MB_ROOK_TABLE ? rook_table : kind==MB_BISHOP_LOOP ? bishop_loop : bishop_table;
+            for (int sq=0;sq<64;sq++) acc ^= fn(sq, p->occ_all);
+            ops += 64;
+        }
+        }
+    }
+    micro_sink = acc;
+    return ops;
+}
+
+static int cmp_double_asc(const void *a, const void *b){
+    double x=*(const double*)a, y=*(const double*)b;
+    return (x>y)-(x<y);
+}
+
+static int bench_micro(int argc, char **argv){
+    int reps=15, warmup=3;
+    const char *path=NULL;
+    CliOptions opt = { .bench_threshold=-1 };
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--reps") && i+1<argc) reps=atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--warmup") && i+1<argc) warmup=atoi(argv[++i]);
+        else if (argv[i][0]!='-') path=argv[i];
+        else if (!cli_setting(&opt, argc, argv, &i)){
+            fprintf(stderr, "usage: bench_micro [--reps N] [--warmup N] [--bench-save F] [--bench-compare F] [--bench-threshold PCT] [positions.epd|positions.bin]\n");
+            return 1;
+        }
+    }
+    if (reps<1) reps=1;
+    BenchReport rep = {0};
+    ray_tables_init();
+    MicroSet set={0};
+    if (path){
+        size_t len=strlen(path);
+        bool ok;
+        if (len>4 && !strcmp(path+len-4, ".bin")){
+            PackedReader r; Position pos; PackedInfo info;
+            ok = ffp_packed_reader_open(&r, path);
+            while (ok && ffp_packed_reader_next(&r, &pos, &info)) micro_add(&set, &pos);
+            if (ok) ffp_packed_reader_close(&r);
+        } else ok = ffp_epd_load(path, 1, micro_add_epd, &set, NULL);
+        if (!ok || !set.count){ fprintf(stderr, "cannot load positions from %s\n", path); free(set.pos); return 1; }
+    } else {
+        // Default set: the bench positions and every position one legal move away
+        for (int i=0;i<BENCH_COUNT;i++){
+            Position pos; MoveList ml;
+            ffp_position_from_fen(&pos, BENCH_FENS[i]);
+            micro_add(&set, &pos);
+            ffp_generate_legal(&pos, &ml);
+            for (int m=0;m<ml.count;m++){ Position q=pos; Undo u; ffp_make_move(&q, ml.list[m], &u); micro_add(&set, &q); }
+        }
+    }
+    // Both slider backends must agree before their speed is worth comparing
+    for (size_t i=0;i<set.count;i++) for (int sq=0;sq<64;sq++){
+        U64 o=set.pos[i].occ_all;
+        if (rook_loop(sq,o)!=rook_table(sq,o) || bishop_loop(sq,o)!=bishop_table(sq,o)){ fprintf(stderr, "slider backends disagree\n"); return 1; }
+    }
+    printf("%zu positions, %d warm-up + %d repetitions%s\n", set.count, warmup, reps,
+           cycle_count() ? "" : " (no cycle counter on this CPU)");
+    printf("%-24s %12s %9s %9s %9s %9s %11s\n", "benchmark", "ops/rep", "median", "p10", "p90", "min", "cycles/op");
+    double *ns = malloc(sizeof(double)*reps), *cyc = malloc(sizeof(double)*reps);
+    for (int k=0;k<MB_COUNT && ns && cyc;k++){
+        uint64_t ops=0;
+        for (int w=0;w<warmup;w++) micro_pass(&set, (MicroKind)k);
+        for (int r=0;r<reps;r++){
+            double t0=wall_seconds(); uint64_t c0=cycle_count();
+            ops = micro_pass(&set, (MicroKind)k);
+            uint64_t c1=cycle_count(); double t1=wall_seconds();
+            ns[r] = (t1-t0)*1e9/ops;
+            cyc[r] = (double)(c1-c0)/ops;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "micro.%s.ns", MICRO_IDS[k]);
+        BenchMetric *m = bench_metric(&rep, name, false, 0);
+        for (int r=0;r<reps;r++) bench_sample(m, ns[r]);
+        qsort(ns, reps, sizeof(double), cmp_double_asc);
+        qsort(cyc, reps, sizeof(double), cmp_double_asc);
+        printf("%-24s %12llu %7.2fns %7.2fns %7.2fns %7.2fns %11.1f\n", MICRO_NAMES[k], (unsigned long long)ops,
+               ns[reps/2], ns[reps/10], ns[reps-1-reps/10], ns[0], cyc[reps/2]);
+    }
+    free(ns); free(cyc); free(set.pos);
+    return bench_finish(&rep, opt.bench_save, opt.bench_compare, opt.bench_threshold, 0);
+}
+#endif
+
+int main(int argc,char **argv){
+#ifdef FFP_BENCH_MICRO
+    return bench_micro(argc, argv);
+#endif
+    Position pos; set_from_fen(&pos, FFP_FEN_STARTPOS);
+    CliOptions opt = { .threads=1, .random_plies=-1, .bench_threshold=-1 };
+    for (int i=1;i<argc;i++) cli_setting(&opt, argc, argv, &i);
+    if (opt.profile) atexit(cli_profile_report);
+    if (opt.trace) trace_start(opt.trace);
+    if (opt.affinity) pool_reserve(&shared_pool, opt.threads, opt.affinity);
+    int threads = opt.threads;
+    if (argc==1){
+        ffp_print_board(&pos);
+        SearchLimits limits = {.max_depth=4};
+        SearchResult res = ffp_search(&pos, &limits);
+        Move best=res.best_move;
+        printf("Suggest: "); print_move(best); printf(" (depth 4)\n");
+        return 0;
+    }
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--help")) { usage(); return 0; }
+        else if (!strcmp(argv[i],"--uci")) { uci_loop(); return 0; }
+        else if (!strcmp(argv[i],"--fen") && i+1<argc) { ffp_position_from_fen(&pos, argv[++i]); }
+        else if (cli_setting(&opt, argc, argv, &i)) { continue; }
+        else if (!strcmp(argv[i],"--epd") && i+1<argc) { return cmd_epd(argv[++i], threads); }
+        else if (!strcmp(argv[i],"--pgn") && i+1<argc) { return cmd_pgn(argv[++i], threads); }
+        else if (!strcmp(argv[i],"--analyse") && i+1<argc) { return cmd_analyse(argv[++i], &opt); }
+        else if (!strcmp(argv[i],"--solve") && i+1<argc) { return cmd_solve(argv[++i], &opt); }
+        else if (!strcmp(argv[i],"--serve") && i+1<argc) { return cmd_serve(argv[++i], &opt); }
+        else if (!strcmp(argv[i],"--jsonl")) { return cmd_jsonl(&opt); }
+        else if (!strcmp(argv[i],"--datagen") && i+1<argc) { return cmd_datagen(argv[++i], &opt); }
+        else if (!strcmp(argv[i],"--tune") && i+1<argc) { return cmd_tune(argv[++i], &opt); }
+        else if (!strcmp(argv[i],"--dedupe") && i+2<argc) { i+=2; return cmd_dedupe(argv[i-1], argv[i], &opt); }
+        else if (!strcmp(argv[i],"--book-build") && i+2<argc) { i+=2; return cmd_book_build(argv[i-1], argv[i], &opt); }
+        else if (!strcmp(argv[i],"bench")){
+            // bench [depth] [threads] [hash]: positional, each optional
+            int v[3] = {0, threads, 16}, n=0;
+            while (n<3 && i+1<argc && isdigit((unsigned char)argv[i+1][0])) v[n++] = atoi(argv[++i]);
+            return cmd_bench(v[0], v[1]>0 ? v[1] : 1, v[2], &opt);
+        }
+        else if (!strcmp(argv[i],"--perft-suite")) { return cmd_perft_suite(&opt); }
+        else if (!strcmp(argv[i],"--pack") && i+2<argc) { i+=2; return cmd_pack(argv[i-1], argv[i]); }
+        else if (!strcmp(argv[i],"--unpack") && i+1<argc) { return cmd_unpack(argv[++i]); }
+        else if (!strcmp(argv[i],"--perft") && i+1<argc){
+            int depth=atoi(argv[++i]);
+            clock_t t0=clock(); uint64_t nodes=perft(&pos, depth);
+            double sec=(double)(clock()-t0)/CLOCKS_PER_SEC;
+            printf("perft(%d) = %llu  (%.3fs, %.0f kn/s)\n", depth, (unsigned long long)nodes, sec, sec>0?(nodes/1000.0/sec):0);
+            return 0;
+        }
+        else if (!strcmp(argv[i],"--search") && i+1<argc){
+            int depth=atoi(argv[++i]);
+            SearchStats stats = {0};
+            HashTable tt = {0};
+            SearchLimits limits = {.max_depth = depth>0?depth:4, .stats = &stats, .threads = threads};
+            if (cli_hash(&tt, &opt)) limits.hash = &tt;
+            SearchResult res = ffp_search(&pos, &limits);
+            ffp_hash_free(&tt);
+            Move best=res.best_move;
+            printf("best move: "); print_move(best); printf("\n");
+            if (opt.search_stats) cli_search_stats(&stats);
+            return 0;
+        }
+        else if (!strcmp(argv[i],"--search-time") && i+1<argc){
+            int ms=atoi(argv[++i]);
+            SearchStats stats = {0};
+            HashTable tt = {0};
+            SearchLimits limits = {.time_ms = ms>0?ms:0, .stats = &stats, .threads = threads};
+            if (cli_hash(&tt, &opt)) limits.hash = &tt;
+            SearchResult res = ffp_search(&pos, &limits);
+            ffp_hash_free(&tt);
+            Move best=res.best_move;
+            printf("best move: "); print_move(best); printf("\n");
+            if (opt.search_stats) cli_search_stats(&stats);
+            return 0;
         }
         else { usage(); return 1; }
     }
     ffp_print_board(&pos);
     return 0;
 }
+#endif /* FFP_NO_MAIN */
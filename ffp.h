@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -40,33 +41,215 @@ typedef struct {
     int ep_square;
     int halfmove_clock;
     int fullmove_number;
+    U64 key;                    /* Zobrist key, maintained by make/unmake */
 } Position;
 
 typedef struct {
     int castling, ep_square, halfmove_clock, fullmove_number, captured;
+    U64 key;
 } Undo;
 
+#define FFP_MAX_PLY 64
+
+typedef struct HashEntry HashEntry;
+
+enum { FFP_PAGES_NORMAL, FFP_PAGES_TRANSPARENT, FFP_PAGES_HUGETLB };
+
+typedef struct {
+    HashEntry *entries;
+    size_t mask;                /* Entry count - 1 (power of two) */
+    size_t bytes;               /* Mapped size, a multiple of 2 MB */
+    int pages;                  /* FFP_PAGES_*; TRANSPARENT = madvise(MADV_HUGEPAGE) accepted */
+    void *segment;              /* Shared-memory mapping (ffp_hash_attach), NULL = private */
+} HashTable;
+
+typedef struct {
+    uint64_t nodes;
+    uint64_t tt_probes, tt_hits, tt_cutoffs;
+    uint64_t cutoffs, first_cutoffs;    /* Beta cutoffs, and those caused by the first move searched */
+    int seldepth;
+} SearchDepthStats;
+
+typedef struct {
+    SearchDepthStats depth[FFP_MAX_PLY];  /* Indexed by iteration depth */
+    int depths;                 /* Deepest iteration with data */
+} SearchStats;
+
+typedef struct SearchResult SearchResult;
+
+/* Progress reports, called on the searching thread without locks; keep them short.
+   With Lazy SMP, nodes counts every thread, the helpers' to within 1024 nodes each. */
+typedef struct {
+    void (*iteration)(const SearchResult *res, void *user);  /* Completed iteration */
+    void (*best_move)(const SearchResult *res, void *user);  /* New best root move inside an iteration (depth_reached = that iteration) */
+    void (*finish)(const SearchResult *res, void *user);     /* Final result, always called once */
+    void *user;
+    int min_interval_ms;        /* At most one iteration and one best_move call per interval, 0 = all */
+} SearchCallbacks;
+
 typedef struct {
     int max_depth;              /* Maximum search depth 0 = default */
     int time_ms;                /* Maximum thinking time in milliseconds 0 = unlimited */
     uint64_t node_limit;        /* Maximum number of nodes to visit 0 = unlimited */
     const volatile bool *stop;  /* Optional external stop flag */
+    HashTable *hash;            /* Optional transposition table, NULL = none */
+    SearchStats *stats;         /* Optional, counters are added in; only filled when built with FFP_STATS */
+    int threads;                /* Lazy SMP threads sharing `hash` (needs one), 0/1 = single-threaded */
+    const SearchCallbacks *callbacks;  /* Optional progress reports */
 } SearchLimits;
 
-typedef struct {
+struct SearchResult {
     Move best_move;
     int depth_reached;
     int score;
     uint64_t nodes;
     bool aborted;
-} SearchResult;
+    int pv_length;
+    Move pv[FFP_MAX_PLY];       /* Principal variation, pv[0] = best_move */
+    double seconds;             /* Wall time since the search started */
+};
+
+typedef struct FfpEngine FfpEngine;
+
+typedef struct {
+    int hash_mb;                /* Transposition table size, 0 = 16 */
+    int threads;                /* Search threads (Lazy SMP), 0 = 1 */
+    int affinity;               /* 0 = none, 1 = one CPU per pool thread, 2 = one NUMA node per pool thread */
+    const char *shared_hash;    /* Name of a table shared with other processes (ffp_hash_attach), NULL = private */
+} EngineOptions;
+
+/* Evaluation weights in centipawns, indexed like the white pieces (WP..WQ) */
+enum { FFP_EVAL_PAWN, FFP_EVAL_ROOK, FFP_EVAL_KNIGHT, FFP_EVAL_BISHOP, FFP_EVAL_QUEEN, FFP_EVAL_PARAMS };
+
+#define FFP_EPD_MAX_OPS 16
+
+typedef struct {
+    const char *name, *value;   /* Point into the source text, not NUL-terminated */
+    int name_len, value_len;    /* Surrounding quotes are stripped from single-string values */
+} EpdOp;
+
+typedef struct {
+    Position pos;
+    const char *line;           /* Raw line in the source text (no newline) */
+    size_t line_len;
+    size_t offset;              /* Byte offset of the line in the source */
+    int worker;                 /* Loader thread that parsed the record */
+    int op_count;               /* Opcodes beyond FFP_EPD_MAX_OPS are dropped */
+    EpdOp ops[FFP_EPD_MAX_OPS];
+} EpdRecord;
+
+typedef bool (*EpdCallback)(const EpdRecord *rec, void *user); /* Return false to stop */
+
+typedef struct {
+    uint64_t records;
+    uint64_t errors;            /* Non-blank lines that are not valid FEN/EPD */
+    size_t bytes;
+    double seconds;
+} EpdStats;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    bool mapped;                /* false: data was read into a heap buffer */
+} MappedFile;
+
+#define FFP_PACKED_SIZE 32
+
+enum { FFP_RESULT_NONE=0, FFP_RESULT_BLACK_WIN=1, FFP_RESULT_DRAW=2, FFP_RESULT_WHITE_WIN=3 };
+
+typedef struct {
+    uint8_t bytes[FFP_PACKED_SIZE];
+} PackedPosition;
+
+typedef struct {
+    int16_t score;              /* Centipawns from white's point of view */
+    bool has_score;
+    uint8_t result;             /* FFP_RESULT_* */
+    uint16_t move;              /* ffp_move_pack() encoding, 0 = none */
+} PackedInfo;
+
+typedef struct {
+    MappedFile file;
+    const PackedPosition *records;
+    size_t count;
+    size_t cursor;
+} PackedReader;
+
+typedef struct {
+    FILE *fp;
+    PackedPosition *buf;
+    size_t used;
+    uint64_t written;
+    bool failed;
+} PackedWriter;
+
+#define FFP_PGN_MAX_TAGS 32
+
+typedef struct {
+    const char *name, *value;   /* Point into the source text, not NUL-terminated, escapes kept */
+    int name_len, value_len;
+} PgnTag;
+
+typedef struct {
+    PgnTag tags[FFP_PGN_MAX_TAGS];
+    int tag_count;              /* Tags beyond FFP_PGN_MAX_TAGS are dropped */
+    Position start;             /* FEN tag or the start position */
+    int result;                 /* FFP_RESULT_*, from the Result tag or the movetext terminator */
+    int plies;                  /* Moves replayed so far */
+    size_t offset;              /* Byte offset of the game in the source */
+    int worker;                 /* Reader thread that parsed the game */
+} PgnGame;
+
+typedef struct {
+    bool (*on_move)(const PgnGame *game, const Position *pos, const Move *move, void *user); /* pos is before move; false skips the rest of the game */
+    void (*on_game)(const PgnGame *game, const Position *final_pos, bool ok, void *user);   /* ok is false if a move did not resolve */
+    void *user;
+} PgnCallbacks;
+
+typedef struct {
+    uint64_t games;
+    uint64_t moves;
+    uint64_t errors;            /* Games with an unresolvable or illegal move */
+    size_t bytes;
+    double seconds;
+} PgnStats;
+
+typedef struct {
+    MappedFile file;
+    const uint8_t *entries;     /* 16-byte big-endian Polyglot entries, sorted by key */
+    size_t count;
+} PolyglotBook;
 
 extern const char *FFP_FEN_STARTPOS;
+extern int ffp_eval_params[FFP_EVAL_PARAMS]; /* Read by every search; change only while none runs */
 
 void ffp_position_clear(Position *pos);
 bool ffp_position_from_fen(Position *pos, const char *fen);
 void ffp_position_set_start(Position *pos);
 bool ffp_position_to_fen(const Position *pos, char *buffer, size_t length);
+U64 ffp_position_key(const Position *pos);
+void ffp_position_mirror(const Position *in, Position *out); /* Colour flip; in and out may alias */
+
+bool ffp_file_map(MappedFile *file, const char *path);
+void ffp_file_unmap(MappedFile *file);
+
+bool ffp_epd_parse_line(const char *line, size_t len, EpdRecord *rec);
+bool ffp_epd_next(const char *data, size_t size, size_t *cursor, EpdRecord *rec, uint64_t *errors);
+const EpdOp *ffp_epd_find_op(const EpdRecord *rec, const char *name);
+int ffp_epd_split(const char *data, size_t size, int parts, size_t *bounds);
+bool ffp_epd_load(const char *path, int threads, EpdCallback cb, void *user, EpdStats *stats);
+
+bool ffp_position_pack(const Position *pos, const PackedInfo *info, PackedPosition *out);
+bool ffp_position_unpack(const PackedPosition *in, Position *pos, PackedInfo *info);
+uint16_t ffp_move_pack(const Move *move);
+bool ffp_move_unpack(const Position *pos, uint16_t packed, Move *out);
+
+bool ffp_packed_reader_open(PackedReader *r, const char *path);
+bool ffp_packed_reader_next(PackedReader *r, Position *pos, PackedInfo *info);
+void ffp_packed_reader_close(PackedReader *r);
+bool ffp_packed_writer_open(PackedWriter *w, const char *path);
+bool ffp_packed_writer_write(PackedWriter *w, const PackedPosition *rec, size_t count);
+bool ffp_packed_writer_close(PackedWriter *w);
 
 void ffp_generate_pseudo_legal(const Position *pos, MoveList *ml);
 void ffp_generate_legal(const Position *pos, MoveList *ml);
@@ -77,10 +260,51 @@ void ffp_unmake_move(Position *pos, const Move move, const Undo *undo);
 
 bool ffp_is_square_attacked(const Position *pos, int square, Side by);
 
+bool ffp_hash_init(HashTable *tt, size_t mb);
+void ffp_hash_free(HashTable *tt);
+void ffp_hash_clear(HashTable *tt);
+void ffp_hash_clear_parallel(HashTable *tt, int threads); /* Each thread first-touches its own slice */
+const char *ffp_hash_pages(const HashTable *tt);         /* Page size obtained, for display */
+/* Creates the named POSIX shared-memory table, or attaches to it with the size
+   its creator chose (mb is then ignored). Processes attached to the same name
+   share entries lock-free; ffp_hash_free detaches and the last process to
+   detach removes the name. On failure errno is ESTALE if the name is held by
+   an object whose creator died before finishing it; it has to be removed
+   (shm_unlink, or /dev/shm/NAME on Linux) before the name can be used again. */
+bool ffp_hash_attach(HashTable *tt, const char *name, size_t mb);
+
+int ffp_evaluate(const Position *pos);  /* Static score from the side to move's point of view */
 SearchResult ffp_search(Position *pos, const SearchLimits *limits);
+void ffp_search_stats_merge(SearchStats *into, const SearchStats *from);
+uint64_t ffp_perft(Position *pos, int depth);
+
+/* Engines own their hash table and worker threads; one engine runs one search at
+   a time, different engines may search concurrently. limits->hash and
+   limits->threads are ignored, callbacks (if not NULL) replace limits->callbacks.
+   Unless limits->stop is given, ffp_engine_stop() (from any thread) ends the
+   current search. */
+FfpEngine *ffp_engine_create(const EngineOptions *options);  /* NULL options = defaults */
+void ffp_engine_destroy(FfpEngine *engine);
+bool ffp_engine_set_option(FfpEngine *engine, const char *name, const char *value); /* Hash, Threads, Affinity (none|cpu|node), SharedHash (name, empty = private), Clear Hash */
+void ffp_engine_new_game(FfpEngine *engine);
+void ffp_engine_stop(FfpEngine *engine);
+const HashTable *ffp_engine_hash(const FfpEngine *engine);
+SearchResult ffp_engine_search(FfpEngine *engine, Position *pos, const SearchLimits *limits, const SearchCallbacks *callbacks); /* NULL engine = aborted, no move */
 
 void ffp_move_to_string(const Move *move, char out[6]);
 bool ffp_move_from_string(const Position *pos, const char *uci, Move *out_move);
+bool ffp_move_to_san(const Position *pos, const Move *move, char out[8]);
+bool ffp_move_from_san(const Position *pos, const char *san, Move *out_move);
+
+const PgnTag *ffp_pgn_find_tag(const PgnGame *game, const char *name);
+bool ffp_pgn_read(const char *data, size_t size, int threads, const PgnCallbacks *cb, PgnStats *stats);
+bool ffp_pgn_read_file(const char *path, int threads, const PgnCallbacks *cb, PgnStats *stats);
+
+U64 ffp_polyglot_key(const Position *pos);
+bool ffp_book_open(PolyglotBook *book, const char *path);
+void ffp_book_close(PolyglotBook *book);
+int ffp_book_probe(const PolyglotBook *book, const Position *pos, Move *moves, uint16_t *weights, int max);
+bool ffp_book_pick(const PolyglotBook *book, const Position *pos, uint64_t *rng, Move *out); /* Weighted random; rng is a seed/state */
 
 void ffp_print_board(const Position *pos);
 